@@ -46,12 +46,14 @@
 #endif
 
 #include <math.h>
+#include <vector>
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
 #endif
 
 //Mion: for special graphics routine handling
 AcceleratedGraphicsFunctions AnimationInfo::gfx;
+unsigned int AnimationInfo::showing_changes = 0;
 
 
 AnimationInfo::AnimationInfo()
@@ -65,6 +67,7 @@ AnimationInfo::AnimationInfo()
     trans_mode    = TRANS_TOPLEFT;
     affine_flag   = false;
     locked        = 0;
+    showing_      = false;
     reset();
 }
 
@@ -74,6 +77,7 @@ AnimationInfo::AnimationInfo(const AnimationInfo &anim)
     //deepcopy(anim);
     memcpy(this, &anim, sizeof(AnimationInfo));
     is_copy = true;
+    if (showing_) ++showing_changes;
     LOG_F(INFO, "animinfo '%s': made a copy (constr)", (const char*)anim.image_name);
     fflush(stdout);
 }
@@ -88,6 +92,7 @@ AnimationInfo::~AnimationInfo()
 AnimationInfo& AnimationInfo::operator =(const AnimationInfo &anim)
 {
     if (this != &anim){
+        if (showing_ != anim.showing_) ++showing_changes;
         memcpy(this, &anim, sizeof(AnimationInfo));
         is_copy = true;
     }
@@ -100,7 +105,9 @@ void AnimationInfo::deepcopy(const AnimationInfo &anim)
     if (this != &anim){
         reset();
         //copy the whole object
+        // reset() has stopped this showing
         memcpy(this, &anim, sizeof(AnimationInfo));
+        if (showing_) ++showing_changes;
         if (anim.is_copy){
             return;
         }
@@ -161,6 +168,7 @@ void AnimationInfo::reset()
     pos.x = pos.y = 0;
     pos.w = pos.h = 0;
     abs_flag = true;
+    if (showing_) ++showing_changes;
     showing_ = false;
     visible_ = false;
     enabled_ = true;
@@ -390,6 +398,16 @@ int AnimationInfo::getPixelAlpha(int x, int y)
 }
 
 
+// How many of the w pixels from src on lie before srcmax, the end of
+// the source image; rows are cut short there rather than read past it.
+template <typename Px>
+static inline int rowInSource(const Px* src, const Px* srcmax, int w)
+{
+    if (src + w <= srcmax) return w;
+    return src < srcmax ? int(srcmax - src) : 0;
+}
+
+
 void AnimationInfo::blendOnSurface(SDL_Surface* dst_surface, int dst_x,
                                    int dst_y, SDL_Rect &clip, int alpha)
 {
@@ -436,41 +454,44 @@ void AnimationInfo::blendOnSurface(SDL_Surface* dst_surface, int dst_x,
                 image_surface->w * image_surface->h;
 
             for (int i=dst_rect.h ; i ; --i){
-                for (int j=dst_rect.w ; j ; --j, src_buffer++, dst_buffer++){
-                    // If we've run out of source area, ignore the remainder.
-                    if (src_buffer >= srcmax) goto break2;
-                    SET_PIXEL(*src_buffer, 0xff);
-                }
-                src_buffer += total_width - dst_rect.w;
+                // If we've run out of source area, ignore the remainder.
+                int w = rowInSource(src_buffer, srcmax, dst_rect.w);
+                if (w <= 0) goto break2;
 #ifdef BPP16
-                alphap += image_surface->w - dst_rect.w;
+                for (int j=w ; j ; --j, src_buffer++, dst_buffer++)
+                    SET_PIXEL(*src_buffer, 0xff);
+                src_buffer += total_width - w;
+                alphap += image_surface->w - w;
+                dst_buffer += dst_surface->w - w;
 #else
-                alphap += (image_surface->w - dst_rect.w)*4;
+                memcpy(dst_buffer, src_buffer, w * sizeof(ONSBuf));
+                src_buffer += total_width;
+                dst_buffer += dst_surface->w;
 #endif
-                dst_buffer += dst_surface->w  - dst_rect.w;
+                if (w < dst_rect.w) goto break2;
             }
         } else if (alpha != 0) {
             ONSBuf* srcmax = (ONSBuf*)image_surface->pixels +
                 image_surface->w * image_surface->h;
 
             for (int i=dst_rect.h ; i ; --i){
+                // If we've run out of source area, ignore the remainder.
+                int w = rowInSource(src_buffer, srcmax, dst_rect.w);
+                if (w <= 0) goto break2;
 #ifdef BPP16
-                for (int j=dst_rect.w ; j ; --j, src_buffer++, dst_buffer++){
-                    // If we've run out of source area, ignore the remainder.
-                    if (src_buffer >= srcmax) goto break2;
+                for (int j=w ; j ; --j, src_buffer++, dst_buffer++){
                     BLEND_PIXEL();
                 }
-                src_buffer += total_width - dst_rect.w;
-                dst_buffer += dst_surface->w - dst_rect.w;
-                alphap += image_surface->w - dst_rect.w;
+                src_buffer += total_width - w;
+                dst_buffer += dst_surface->w - w;
+                alphap += image_surface->w - w;
 #else
-                if (src_buffer >= srcmax) goto break2;
-                gfx.imageFilterBlend(dst_buffer, src_buffer, alphap, alpha,
-                                 dst_rect.w);
+                gfx.imageFilterBlend(dst_buffer, src_buffer, alphap, alpha, w);
                 src_buffer += total_width;
                 dst_buffer += dst_surface->w;
                 alphap += (image_surface->w)*4;
 #endif
+                if (w < dst_rect.w) goto break2;
             }
         }
 #ifndef BPP16
@@ -483,8 +504,10 @@ void AnimationInfo::blendOnSurface(SDL_Surface* dst_surface, int dst_x,
             Uint8* dst_buf = (Uint8*) dst_buffer;
 
             for (int i=dst_rect.h ; i ; --i){
-                if (src_buf >= srcmax) goto break2;
-                gfx.imageFilterAddTo(dst_buf, src_buf, dst_rect.w*4);
+                int w = rowInSource(src_buf, srcmax, dst_rect.w*4);
+                if (w <= 0) goto break2;
+                gfx.imageFilterAddTo(dst_buf, src_buf, w);
+                if (w < dst_rect.w*4) goto break2;
                 src_buf += total_width * 4;
                 dst_buf += dst_surface->w * 4;
             }
@@ -494,14 +517,13 @@ void AnimationInfo::blendOnSurface(SDL_Surface* dst_surface, int dst_x,
                 image_surface->w * image_surface->h;
 
             for (int i=dst_rect.h ; i ; --i){
-                for (int j=dst_rect.w ; j ; --j, src_buffer++, dst_buffer++){
-                    // If we've run out of source area, ignore the remainder.
-                    if (src_buffer >= srcmax) goto break2;
-                        ADDBLEND_PIXEL();
-                    }
-                src_buffer += total_width - dst_rect.w;
-                alphap += (image_surface->w - dst_rect.w)*4;
-                dst_buffer += dst_surface->w  - dst_rect.w;
+                int w = rowInSource(src_buffer, srcmax, dst_rect.w);
+                if (w <= 0) goto break2;
+                gfx.imageFilterAddBlend(dst_buffer, src_buffer, alphap, alpha, w);
+                if (w < dst_rect.w) goto break2;
+                src_buffer += total_width;
+                alphap += (image_surface->w)*4;
+                dst_buffer += dst_surface->w;
             }
         }
     } else if (blending_mode == BLEND_SUB) {
@@ -513,8 +535,10 @@ void AnimationInfo::blendOnSurface(SDL_Surface* dst_surface, int dst_x,
             Uint8* dst_buf = (Uint8*) dst_buffer;
 
             for (int i=dst_rect.h ; i ; --i){
-                if (src_buf >= srcmax) goto break2;
-                gfx.imageFilterSubFrom(dst_buf, src_buf, dst_rect.w*4);
+                int w = rowInSource(src_buf, srcmax, dst_rect.w*4);
+                if (w <= 0) goto break2;
+                gfx.imageFilterSubFrom(dst_buf, src_buf, w);
+                if (w < dst_rect.w*4) goto break2;
                 src_buf += total_width * 4;
                 dst_buf += dst_surface->w * 4;
             }
@@ -524,14 +548,13 @@ void AnimationInfo::blendOnSurface(SDL_Surface* dst_surface, int dst_x,
                 image_surface->w * image_surface->h;
 
             for (int i=dst_rect.h ; i ; --i){
-                for (int j=dst_rect.w ; j ; --j, src_buffer++, dst_buffer++){
-                    // If we've run out of source area, ignore the remainder.
-                    if (src_buffer >= srcmax) goto break2;
-                        SUBBLEND_PIXEL();
-                    }
-                src_buffer += total_width - dst_rect.w;
-                alphap += (image_surface->w - dst_rect.w)*4;
-                dst_buffer += dst_surface->w  - dst_rect.w;
+                int w = rowInSource(src_buffer, srcmax, dst_rect.w);
+                if (w <= 0) goto break2;
+                gfx.imageFilterSubBlend(dst_buffer, src_buffer, alphap, alpha, w);
+                if (w < dst_rect.w) goto break2;
+                src_buffer += total_width;
+                alphap += (image_surface->w)*4;
+                dst_buffer += dst_surface->w;
             }
         }
     }
@@ -544,6 +567,33 @@ break2:
 }
 
 
+#ifndef BPP16
+// Blends n pixels gathered from a sprite onto a run of dst_buffer, in the
+// way blendOnSurface blends a row of the sprite.
+static void blendRun(int blending_mode, int trans_mode,
+                     AnimationInfo::ONSBuf* dst_buffer,
+                     AnimationInfo::ONSBuf* src_buffer, int alpha, int n)
+{
+    if (n <= 0) return;
+#if SDL_BYTEORDER == SDL_LIL_ENDIAN
+    unsigned char* alphap = (unsigned char*) src_buffer + 3;
+#else
+    unsigned char* alphap = (unsigned char*) src_buffer;
+#endif
+    if (blending_mode == AnimationInfo::BLEND_NORMAL) {
+        if ((trans_mode == AnimationInfo::TRANS_COPY) && (alpha == 256))
+            memcpy(dst_buffer, src_buffer, n * sizeof(*dst_buffer));
+        else
+            AnimationInfo::gfx.imageFilterBlend(dst_buffer, src_buffer, alphap, alpha, n);
+    } else if (blending_mode == AnimationInfo::BLEND_ADD) {
+        AnimationInfo::gfx.imageFilterAddBlend(dst_buffer, src_buffer, alphap, alpha, n);
+    } else if (blending_mode == AnimationInfo::BLEND_SUB) {
+        AnimationInfo::gfx.imageFilterSubBlend(dst_buffer, src_buffer, alphap, alpha, n);
+    }
+}
+#endif
+
+
 void AnimationInfo::blendOnSurface2(SDL_Surface* dst_surface, int dst_x,
                                     int dst_y, SDL_Rect &clip, int alpha)
 {
@@ -552,10 +602,18 @@ void AnimationInfo::blendOnSurface2(SDL_Surface* dst_surface, int dst_x,
 
     int i, x, y;
 
-    // project corner point and calculate bounding box
-    int min_xy[2] = { bounding_rect.x, bounding_rect.y };
-    int max_xy[2] = { bounding_rect.x + bounding_rect.w - 1,
-                      bounding_rect.y + bounding_rect.h - 1 };
+    // project corner point and calculate bounding box; the caller may
+    // draw the sprite away from pos (text-relative sprites), so move
+    // them with it
+    int off_x = dst_x - pos.x, off_y = dst_y - pos.y;
+    int corner[4][2];
+    for (i = 0; i < 4; i++) {
+        corner[i][0] = corner_xy[i][0] + off_x;
+        corner[i][1] = corner_xy[i][1] + off_y;
+    }
+    int min_xy[2] = { bounding_rect.x + off_x, bounding_rect.y + off_y };
+    int max_xy[2] = { min_xy[0] + bounding_rect.w - 1,
+                      min_xy[1] + bounding_rect.h - 1 };
 
     // clip bounding box
     if (max_xy[0] < clip.x) return;
@@ -574,19 +632,26 @@ void AnimationInfo::blendOnSurface2(SDL_Surface* dst_surface, int dst_x,
     int total_width = image_surface->pitch / 2;
 #else
     int total_width = image_surface->pitch / 4;
+    // Source pixels along a scanline are gathered here, so that each run
+    // can go through the same row routines as blendOnSurface.
+    static thread_local std::vector<ONSBuf> run_buffer;
+    if (run_buffer.size() < size_t(max_xy[0] - min_xy[0] + 1))
+        run_buffer.resize(max_xy[0] - min_xy[0] + 1);
 #endif
+    ONSBuf* src_base = (ONSBuf*) image_surface->pixels + pos.w * current_cell;
+
     // set pixel by inverse-projection with raster scan
     for (y = min_xy[1]; y <= max_xy[1]; y++) {
         // calculate the start and end point for each raster scan
         int raster_min = min_xy[0], raster_max = max_xy[0];
         for (i = 0; i < 4; i++) {
-            if (corner_xy[i][1] == corner_xy[(i + 1) % 4][1])
+            if (corner[i][1] == corner[(i + 1) % 4][1])
                 continue;
-            x = ((corner_xy[(i + 1) % 4][0] - corner_xy[i][0]) *
-                 (y - corner_xy[i][1]) /
-                 (corner_xy[(i + 1) % 4][1] - corner_xy[i][1])) +
-                corner_xy[i][0];
-            if (corner_xy[(i + 1) % 4][1] - corner_xy[i][1] > 0) {
+            x = ((corner[(i + 1) % 4][0] - corner[i][0]) *
+                 (y - corner[i][1]) /
+                 (corner[(i + 1) % 4][1] - corner[i][1])) +
+                corner[i][0];
+            if (corner[(i + 1) % 4][1] - corner[i][1] > 0) {
                 if (raster_min < x) raster_min = x;
             }
             else {
@@ -599,39 +664,47 @@ void AnimationInfo::blendOnSurface2(SDL_Surface* dst_surface, int dst_x,
         // inverse-projection
         int x_offset = inv_mat[0][1] * (y - dst_y) / 1000 + pos.w / 2;
         int y_offset = inv_mat[1][1] * (y - dst_y) / 1000 + pos.h / 2;
-        for (x = raster_min - dst_x; x <= raster_max - dst_x; x++, dst_buffer++) {
-            int x2 = inv_mat[0][0] * x / 1000 + x_offset;
-            int y2 = inv_mat[1][0] * x / 1000 + y_offset;
-
-            if (x2 < 0 || x2 >= pos.w
-                || y2 < 0 || y2 >= pos.h) continue;
+        x = raster_min - dst_x;
+        // inv_mat[k][0] * x / 1000 is stepped along the scanline rather
+        // than divided out per pixel
+        TruncDivStepper x_step(inv_mat[0][0], x, 1000);
+        TruncDivStepper y_step(inv_mat[1][0], x, 1000);
+#ifndef BPP16
+        ONSBuf* run_dst = dst_buffer;
+        int run = 0;
+#endif
+        for (; x <= raster_max - dst_x; x++, dst_buffer++) {
+            int x2 = x_step.value() + x_offset;
+            int y2 = y_step.value() + y_offset;
+            x_step.next();
+            y_step.next();
+
+            if ((unsigned) x2 >= (unsigned) pos.w
+                || (unsigned) y2 >= (unsigned) pos.h) {
+#ifndef BPP16
+                blendRun(blending_mode, trans_mode, run_dst,
+                         &run_buffer[0], alpha, run);
+                run_dst = dst_buffer + 1;
+                run = 0;
+#endif
+                continue;
+            }
 
-            ONSBuf* src_buffer = (ONSBuf*) image_surface->pixels + total_width * y2 + x2 + pos.w * current_cell;
+            ONSBuf* src_buffer = src_base + total_width * y2 + x2;
 #ifdef BPP16
             unsigned char* alphap = alpha_buf + image_surface->w * y2 + x2 + pos.w * current_cell;
+            if ((trans_mode == TRANS_COPY) && (alpha == 256)) {
+                SET_PIXEL(*src_buffer, 0xff);
+            } else {
+                BLEND_PIXEL();
+            }
 #else
-#if SDL_BYTEORDER == SDL_LIL_ENDIAN
-            unsigned char* alphap = (unsigned char*) src_buffer + 3;
-#else
-            unsigned char* alphap = (unsigned char*) src_buffer;
-#endif
-#endif
-#ifndef BPP16
-            if (blending_mode == BLEND_NORMAL) {
+            run_buffer[run++] = *src_buffer;
 #endif
-                if ((trans_mode == TRANS_COPY) && (alpha == 256)) {
-                    SET_PIXEL(*src_buffer, 0xff);
-                } else {
-                    BLEND_PIXEL();
-                }
+        }
 #ifndef BPP16
-            } else if (blending_mode == BLEND_ADD) {
-                ADDBLEND_PIXEL();
-            } else if (blending_mode == BLEND_SUB) {
-                SUBBLEND_PIXEL();
-            }
+        blendRun(blending_mode, trans_mode, run_dst, &run_buffer[0], alpha, run);
 #endif
-        }
     }
 
     // unlock surface
@@ -1048,6 +1121,7 @@ bool AnimationInfo::update_showing()
     bool do_show = visible_ && enabled_;
     if (showing_ != do_show) {
         showing_ = do_show;
+        ++showing_changes;
         return true;
     }
     return false;   
@@ -142,6 +142,10 @@ public:
     bool visible(bool flag);
     bool enabled(bool flag);
     int savestate();
+
+    // Bumped whenever any AnimationInfo starts or stops showing, so
+    // lists of showing sprites can tell when to rebuild themselves.
+    static unsigned int showing_changes;
     
     /* Variables for extended sprite (lsp2, drawsp2, etc.) - Mion: ogapee2008 */
     int scale_x, scale_y, rot;
@@ -27,6 +27,7 @@
 #define __BASE_READER_H__
 
 #include "defs.h"
+#include <string.h>
 
 #ifndef SEEK_END
 #define SEEK_END 2
@@ -38,6 +39,13 @@
 #define DELIMITER "/"
 #endif
 
+// Archives are memory-mapped where the platform allows it, so archive
+// entries can be decoded (or used outright) without a seek/read pair.
+#if !defined (WIN32) && !defined (PSP) && !defined (__OS2__)
+#define USE_MMAP_ARCHIVES
+#include <sys/mman.h>
+#endif
+
 struct BaseReader {
     enum {
         NO_COMPRESSION   = 0,
@@ -54,6 +62,46 @@ struct BaseReader {
         ARCHIVE_TYPE_NS3  = 4
     };
 
+    // What was read from one archive, or from loose files, for the
+    // debug inspector and --record-render-time.  Arrays are indexed by
+    // compression type; times are SDL performance counter ticks.
+    struct IOStats {
+        enum { SIZE_BUCKETS = 12 }; // under 2KB, 4KB, ... 2MB, and larger
+
+        Uint64 lookups;       // names found here
+        Uint64 reads;
+        Uint64 bytes_read;    // as stored in the archive
+        Uint64 decodes[NBZ_COMPRESSION + 1];
+        Uint64 bytes_decoded[NBZ_COMPRESSION + 1];
+        Uint64 decode_ticks[NBZ_COMPRESSION + 1];
+        Uint64 sizes[SIZE_BUCKETS]; // reads by decoded size
+
+        IOStats() { memset(this, 0, sizeof(IOStats)); }
+
+        void addRead(int type, size_t stored, size_t decoded, Uint64 ticks) {
+            if (type < 0 || type > NBZ_COMPRESSION) type = NO_COMPRESSION;
+            ++reads;
+            bytes_read += stored;
+            ++decodes[type];
+            bytes_decoded[type] += decoded;
+            decode_ticks[type] += ticks;
+
+            int bucket = 0;
+            while (bucket < SIZE_BUCKETS - 1 && decoded >= (2048u << bucket))
+                ++bucket;
+            ++sizes[bucket];
+        }
+    };
+
+    static const char* compressionName(int type) {
+        switch (type) {
+        case SPB_COMPRESSION:  return "SPB";
+        case LZSS_COMPRESSION: return "LZSS";
+        case NBZ_COMPRESSION:  return "NBZ";
+        default:               return "Raw";
+        }
+    }
+
     struct FileInfo {
         pstring name;
         int compression_type;
@@ -67,22 +115,93 @@ struct BaseReader {
         ArchiveInfo* next;
         FILE* file_handle;
         pstring file_name;
+        pstring open_path; // where file_handle was opened, for reopening
         FileInfo* fi_list;
         unsigned int num_of_files;
         unsigned long base_offset;
+        const unsigned char* map_base; // NULL unless memory-mapped
+        size_t map_length;
+        IOStats stats;
 
         ArchiveInfo() {
             next = NULL;
             file_handle = NULL;
             fi_list = NULL;
             num_of_files = 0;
+            map_base = NULL;
+            map_length = 0;
         }
         ~ArchiveInfo(){
+#ifdef USE_MMAP_ARCHIVES
+            if (map_base) munmap( (void*) map_base, map_length );
+#endif
             if (file_handle) fclose( file_handle );
             if (fi_list) delete[] fi_list;
         }
     };
 
+    // A file located by lookupFile().  Holds everything needed to read
+    // the file back with readFile(), so callers that want both the
+    // length and the contents only resolve the name once.
+    struct FileRef {
+        int location;
+        int compression_type;
+        size_t length;
+        FILE* file_handle;   // loose files only; closed with the FileRef
+        ArchiveInfo* ai;     // archive entries only
+        unsigned int no;
+
+        FileRef()
+            : location(ARCHIVE_TYPE_NONE), compression_type(NO_COMPRESSION),
+              length(0), file_handle(NULL), ai(NULL), no(0) {}
+        ~FileRef() {
+            if (file_handle) fclose(file_handle);
+        }
+
+        FileRef(const FileRef&) = delete;
+        FileRef& operator=(const FileRef&) = delete;
+    };
+
+    // A file being read by getFileAsync().  data and location are only
+    // valid once wait() has returned; until then the reader's worker
+    // threads may be decompressing it.
+    struct AsyncFile {
+        pstring data;
+        int location;
+
+        // What the workers decode from: the entry in a mapped archive,
+        // or a copy of it in raw.
+        int compression_type;
+        const unsigned char* src;
+        size_t src_len, length;
+        pstring raw;
+        IOStats* stats; // where the decode is counted
+
+        AsyncFile()
+            : location(ARCHIVE_TYPE_NONE), compression_type(NO_COMPRESSION),
+              src(NULL), src_len(0), length(0), stats(NULL), done(false)
+        {
+            ready = SDL_CreateSemaphore(0);
+        }
+        ~AsyncFile() {
+            wait();
+            SDL_DestroySemaphore(ready);
+        }
+
+        void wait() {
+            if (!done) SDL_SemWait(ready);
+            done = true;
+        }
+        void finish() { SDL_SemPost(ready); }
+
+        AsyncFile(const AsyncFile&) = delete;
+        AsyncFile& operator=(const AsyncFile&) = delete;
+
+    private:
+        SDL_sem* ready;
+        bool done;
+    };
+
     virtual ~BaseReader() { };
 
     virtual int open(const pstring& name = "",
@@ -98,27 +217,69 @@ struct BaseReader {
 
     virtual FileInfo getFileByIndex(unsigned int index) = 0;
 
+    // Returns false if the file does not exist or is empty.
+    virtual bool lookupFile(const pstring& file_name, FileRef& ref) = 0;
+
+    virtual size_t readFile(FileRef& ref, unsigned char* buffer) = 0;
+
+    pstring readFile(FileRef& ref);
+
+    // Returns the file's contents in place when no decoding is needed
+    // (an uncompressed entry in a memory-mapped archive), or NULL if it
+    // must be read with readFile().  The data is ref.length bytes long
+    // and stays valid until the reader is closed.
+    virtual const unsigned char* getFileView(FileRef& ref) { return NULL; }
+
     virtual size_t getFileLength(const pstring& file_name) = 0;
 
     virtual size_t getFile(const pstring& file_name, unsigned char* buffer,
 			   int* location = NULL) = 0;
 
     pstring getFile(const pstring& file_name, int* location = NULL);
+
+    // Starts reading a file on the reader's thread pool, so several
+    // compressed entries can be decoded at once.  The caller owns the
+    // result and must wait() on it before using its data.
+    virtual AsyncFile* getFileAsync(const pstring& file_name) = 0;
+
+    // Opens a file for reading as it is consumed, for music and video
+    // that would be wasteful to hold in memory whole.  Entries stored
+    // uncompressed are read through a small buffer, and seeking is
+    // supported; compressed entries are decoded up front.  Returns NULL
+    // if the file does not exist.  Close the stream with SDL_RWclose().
+    virtual SDL_RWops* openStream(const pstring& file_name) = 0;
+
+    // Copies the I/O counters for loose files (index 0) or for each
+    // archive in turn, and its name.  Returns false past the last one.
+    virtual bool getIOStats(int index, pstring& name, IOStats& stats)
+        { return false; }
+
+    // Names that were looked up and not found.
+    virtual Uint64 getLookupMisses() { return 0; }
 };
 
 
 inline pstring
-BaseReader::getFile(const pstring& file_name, int* location)
+BaseReader::readFile(FileRef& ref)
 {
-    size_t length = getFileLength(file_name);
-    if (!length) return pstring();
-    char* buf = new char[length];
-    length = getFile(file_name, (unsigned char*) buf, location);
-    
+    if (!ref.length) return pstring();
+    char* buf = new char[ref.length];
+    size_t length = readFile(ref, (unsigned char*) buf);
+
     // roto 20100227 (fixing memory leak)
     pstring data(buf, length);
     delete[] buf;
     return data;
 }
 
+
+inline pstring
+BaseReader::getFile(const pstring& file_name, int* location)
+{
+    FileRef ref;
+    if (!lookupFile(file_name, ref)) return pstring();
+    if (location) *location = ref.location;
+    return readFile(ref);
+}
+
 #endif // __BASE_READER_H__
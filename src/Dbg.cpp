@@ -134,6 +134,75 @@ void Debug::DrawConsole() {
     ImGui::End();
 }
 
+void Debug::DrawIOStats() {
+    static const int types[] = {
+        BaseReader::NO_COMPRESSION, BaseReader::SPB_COMPRESSION,
+        BaseReader::LZSS_COMPRESSION, BaseReader::NBZ_COMPRESSION
+    };
+
+    BaseReader* reader = ScriptHandler::cBR;
+    if (reader == nullptr) {
+        return;
+    }
+
+    double ms_per_tick = 1000.0 / SDL_GetPerformanceFrequency();
+    ImGui::Text("Lookup misses: %llu", (unsigned long long)reader->getLookupMisses());
+
+    std::vector<std::pair<pstring, BaseReader::IOStats>> sources;
+    pstring name;
+    BaseReader::IOStats stats;
+    while (reader->getIOStats(sources.size(), name, stats)) {
+        sources.push_back(std::make_pair(name, stats));
+    }
+
+    auto table_flags = ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg | ImGuiTableFlags_SizingFixedFit;
+    if (ImGui::BeginTable("io_stats", 4 + IM_ARRAYSIZE(types), table_flags)) {
+        ImGui::TableSetupColumn("Source");
+        ImGui::TableSetupColumn("Lookups");
+        ImGui::TableSetupColumn("Reads");
+        ImGui::TableSetupColumn("Read KB");
+        for (int type : types) {
+            ImGui::TableSetupColumn(BaseReader::compressionName(type));
+        }
+        ImGui::TableHeadersRow();
+
+        for (auto& source : sources) {
+            auto& s = source.second;
+            ImGui::TableNextRow();
+            ImGui::TableNextColumn();
+            ImGui::TextUnformatted((const char*)source.first);
+            ImGui::TableNextColumn();
+            ImGui::Text("%llu", (unsigned long long)s.lookups);
+            ImGui::TableNextColumn();
+            ImGui::Text("%llu", (unsigned long long)s.reads);
+            ImGui::TableNextColumn();
+            ImGui::Text("%llu", (unsigned long long)s.bytes_read / 1024);
+            for (int type : types) {
+                ImGui::TableNextColumn();
+                ImGui::Text("%llu / %llu KB / %.1f ms", (unsigned long long)s.decodes[type],
+                            (unsigned long long)s.bytes_decoded[type] / 1024,
+                            s.decode_ticks[type] * ms_per_tick);
+            }
+        }
+        ImGui::EndTable();
+    }
+
+    // Read sizes, in power-of-two buckets from under 2KB up to 2MB and over.
+    for (auto& source : sources) {
+        auto& s = source.second;
+        if (s.reads == 0) {
+            continue;
+        }
+
+        float sizes[BaseReader::IOStats::SIZE_BUCKETS];
+        for (int i = 0; i < BaseReader::IOStats::SIZE_BUCKETS; i++) {
+            sizes[i] = (float)s.sizes[i];
+        }
+        ImGui::PlotHistogram((const char*)source.first, sizes, BaseReader::IOStats::SIZE_BUCKETS,
+                             0, "Read sizes", 0.0f, FLT_MAX, ImVec2(0, 40));
+    }
+}
+
 void Debug::AddLog(LogMessage message) {
     this->messages.push_back(message);
 }
@@ -234,6 +303,16 @@ void Debug::DrawInspector() {
         ImGui::EndMenuBar();
     }
 
+    auto& cache = this->ons->image_cache;
+    ImGui::Text("Image cache: %zu images, %zu / %zu KB", cache.size(),
+                cache.bytes() / 1024, cache.maxBytes() / 1024);
+    ImGui::Text("Hits: %lu  Misses: %lu  Evictions: %lu",
+                cache.hits, cache.misses, cache.evictions);
+
+    if (ImGui::CollapsingHeader("Archive I/O")) {
+        this->DrawIOStats();
+    }
+
     auto style = ImGui::GetStyle();
 
     auto content = ImGui::GetContentRegionAvail();
@@ -47,6 +47,7 @@ class Debug {
         void Draw();
         void DrawConsole();
         void DrawInspector();
+        void DrawIOStats();
         void DrawImageButton(size_t i, AnimationInfo *si);
 
         void AddLog(LogMessage message);
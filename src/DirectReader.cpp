@@ -29,6 +29,7 @@
 #include <bzlib.h>
 #if !defined (WIN32) && !defined (PSP) && !defined (__OS2__)
 #include <dirent.h>
+#include <sys/stat.h>
 #endif
 
 #ifdef WIN32
@@ -48,7 +49,19 @@
 #define SEEK_END 2
 #endif
 
-#define READ_LENGTH 4096
+// How long (in ms) fileopen trusts a cached "file not found" result,
+// and how many it keeps.
+#define MISSING_FILE_TTL 1000
+#define MISSING_FILE_MAX 1024
+
+// The sub-second part of a directory's mtime, where stat gives one.
+// Without it, a change in the second a listing was read can't be seen,
+// so listings then expire after MISSING_FILE_TTL like misses do.
+#if defined(LINUX)
+#define MTIME_NSEC(st) ((st).st_mtim.tv_nsec)
+#elif defined(MACOSX)
+#define MTIME_NSEC(st) ((st).st_mtimespec.tv_nsec)
+#endif
 
 #define EI 8
 #define EJ 4
@@ -73,9 +86,14 @@ DirectReader::DirectReader(DirPaths *path, const unsigned char* key_table)
         for (i = 0; i < 256; i++) this->key_table[i] = (unsigned char) i;
     }
 
-    read_buf = new unsigned char[READ_LENGTH];
-    decomp_buffer = new unsigned char[N * 2];
-    decomp_buffer_len = N * 2;
+    async_lock = SDL_CreateMutex();
+    async_ready = SDL_CreateCond();
+    async_idle = SDL_CreateCond();
+    async_busy = 0;
+    async_quit = false;
+
+    lookup_misses = 0;
+    stats_lock = SDL_CreateMutex();
 
     last_registered_compression_type = &root_registered_compression_type;
     registerCompressionType("SPB", SPB_COMPRESSION);
@@ -86,8 +104,20 @@ DirectReader::DirectReader(DirPaths *path, const unsigned char* key_table)
 
 DirectReader::~DirectReader()
 {
-    delete[] read_buf;
-    delete[] decomp_buffer;
+    waitAsync();
+
+    SDL_LockMutex(async_lock);
+    async_quit = true;
+    SDL_CondBroadcast(async_ready);
+    SDL_UnlockMutex(async_lock);
+
+    for (size_t i = 0; i < async_threads.size(); i++)
+        SDL_WaitThread(async_threads[i], NULL);
+
+    SDL_DestroyCond(async_idle);
+    SDL_DestroyCond(async_ready);
+    SDL_DestroyMutex(async_lock);
+    SDL_DestroyMutex(stats_lock);
 
     last_registered_compression_type = root_registered_compression_type.next;
     while (last_registered_compression_type) {
@@ -111,11 +141,112 @@ bool NonAsciiFilename(const pstring& filename)
 }
 
 
-FILE* DirectReader::fileopen(pstring path, const char* mode)
+#if !defined (WIN32) && !defined (PSP) && !defined (__OS2__)
+const DirectReader::DirListing* DirectReader::getDirListing(const pstring& dir)
+{
+    struct stat st;
+    if (stat(dir, &st) != 0) {
+        dir_cache.erase(dir);
+        return NULL;
+    }
+
+    DirListing& listing = dir_cache[dir];
+#ifdef MTIME_NSEC
+    if (!listing.entries.empty() && listing.mtime == st.st_mtime
+        && listing.mtime_nsec == MTIME_NSEC(st))
+        return &listing;
+#else
+    if (!listing.entries.empty() && listing.mtime == st.st_mtime
+        && SDL_GetTicks() - listing.ticks < MISSING_FILE_TTL)
+        return &listing;
+#endif
+
+    DIR* dp = opendir(dir);
+    if (!dp) {
+        dir_cache.erase(dir);
+        return NULL;
+    }
+
+    listing.mtime = st.st_mtime;
+#ifdef MTIME_NSEC
+    listing.mtime_nsec = MTIME_NSEC(st);
+#else
+    listing.ticks = SDL_GetTicks();
+#endif
+    listing.entries.clear();
+    dirent* entry;
+    while ((entry = readdir(dp))) {
+        pstring item = entry->d_name;
+        pstring key = item;
+        key.tolower();
+        listing.entries.insert(std::make_pair(key, item));
+    }
+    closedir(dp);
+
+    return &listing;
+}
+#endif
+
+
+#if !defined (WIN32) && !defined (PSP) && !defined (__OS2__)
+static Uint64 dirStamp(const pstring& dir)
+{
+    struct stat st;
+    if (stat(dir, &st) != 0) return (Uint64) -1;
+#ifdef MTIME_NSEC
+    return (Uint64) st.st_mtime * 1000000000 + MTIME_NSEC(st);
+#else
+    return st.st_mtime;
+#endif
+}
+#endif
+
+
+// Combines the mtimes of the directories fileopen searches for path, so
+// that it changes when a file is added to any of them.  Where mtimes
+// only count seconds, a file added in the second of the miss is still
+// hidden until the miss expires.  Without stat this is always 0.
+Uint64 DirectReader::searchDirStamp(const pstring& path)
+{
+    Uint64 stamp = 0;
+#if !defined (WIN32) && !defined (PSP) && !defined (__OS2__)
+    pstring parent = "";
+    int slash = path.reversefind(DELIMITER, path.length());
+    if (slash > 0) parent = path.midstr(0, slash);
+
+    int num_paths = archive_path->get_num_paths();
+    for (int n = num_paths ? 0 : -1; n < num_paths; n++) {
+        pstring dir = (n == -1) ? pstring("." DELIMITER) : archive_path->get_path(n);
+        stamp = stamp * 31 + dirStamp(dir);
+        if (parent.length()) {
+            dir += parent;
+            stamp = stamp * 31 + dirStamp(dir);
+        }
+    }
+#endif
+    return stamp;
+}
+
+
+FILE* DirectReader::fileopen(pstring path, const char* mode,
+                             pstring* opened_path)
 {
     pstring full_path = "";
     FILE* fp = NULL;
 
+    const pstring requested_path = path;
+    pstring miss_key = mode;
+    miss_key += ':';
+    miss_key += requested_path;
+    std::unordered_map<pstring, MissingFile, pstring_hash>::iterator miss =
+        missing_files.find(miss_key);
+    if (miss != missing_files.end()) {
+        if (SDL_GetTicks() - miss->second.ticks < MISSING_FILE_TTL
+            && searchDirStamp(path) == miss->second.dir_stamp)
+            return NULL;
+        missing_files.erase(miss);
+    }
+
 #if defined (RECODING_FILENAMES) && !defined (WIN32)
     //preconvert Shift-JIS filename to UTF-8
     //(assumes path uses the script file encoding)
@@ -141,13 +272,19 @@ FILE* DirectReader::fileopen(pstring path, const char* mode)
         // If the file is trivially found, open it and return the handle.
 //printf("DReader::fileopen: about to try '" + full_path + path + "'\n");
         fp = fopen(full_path + path, mode);
-        if (fp) return fp;
+        if (fp) {
+            if (opened_path) *opened_path = full_path + path;
+            return fp;
+        }
 
 #ifndef WIN32
         // Linux/Mac proper paths, since [path] can also sometimes be the full filename
 //printf("DReader::fileopen: about to try '" + path + "'\n");
         fp = fopen(path, mode);
-        if (fp) return fp;
+        if (fp) {
+            if (opened_path) *opened_path = path;
+            return fp;
+        }
 #endif
 
 #ifdef WIN32
@@ -171,7 +308,10 @@ FILE* DirectReader::fileopen(pstring path, const char* mode)
             //printf("checking utf16 filename: %s\n", fp ? "found" : "not found");
             delete[] u16_tmp;
             delete[] umode;
-            if (fp) return fp;
+            if (fp) {
+                if (opened_path) *opened_path = file_full_path;
+                return fp;
+            }
         }
 #endif
 
@@ -190,28 +330,41 @@ FILE* DirectReader::fileopen(pstring path, const char* mode)
         bool found = false;
         for (CBStringList::iterator it = parts.begin(); it != parts.end(); ++it) {
             found = false;
-            DIR* dp = opendir(full_path);
-            if (!dp) {
-                fp = NULL;
-                break;
-            }
-            dirent* entry;
-            while ((entry = readdir(dp))) {
-                pstring item = entry->d_name;
-                if (it->caselessEqual(item)) {
-                    found = true;
-                    full_path += DELIMITER;
-                    full_path += item;
-                    break;
-                }
-            }
-            closedir(dp);
+            const DirListing* listing = getDirListing(full_path);
+            if (!listing) break;
+
+            pstring key = *it;
+            key.tolower();
+            std::unordered_map<pstring, pstring, pstring_hash>::const_iterator
+                item = listing->entries.find(key);
+            if (item == listing->entries.end()) break;
+
+            found = true;
+            full_path += DELIMITER;
+            full_path += item->second;
         }
         if (!found) continue;
         fp = fopen(full_path, mode);
-        if (fp) return fp;
+        if (fp) {
+            if (opened_path) *opened_path = full_path;
+            return fp;
+        }
 #endif
     }
+
+    Uint32 now = SDL_GetTicks();
+    if (missing_files.size() >= MISSING_FILE_MAX) {
+        for (miss = missing_files.begin(); miss != missing_files.end();) {
+            if (now - miss->second.ticks >= MISSING_FILE_TTL)
+                miss = missing_files.erase(miss);
+            else
+                ++miss;
+        }
+        if (missing_files.size() >= MISSING_FILE_MAX) missing_files.clear();
+    }
+    MissingFile& entry = missing_files[miss_key];
+    entry.ticks = now;
+    entry.dir_stamp = searchDirStamp(requested_path);
     return fp;
 }
 
@@ -250,6 +403,28 @@ unsigned long DirectReader::readLong(FILE* fp)
 }
 
 
+void DirectReader::mapArchive(ArchiveInfo* ai)
+{
+#ifdef USE_MMAP_ARCHIVES
+    struct stat st;
+    if (fstat(fileno(ai->file_handle), &st) != 0 || st.st_size <= 0 ||
+        (unsigned long long) st.st_size > std::numeric_limits<size_t>::max())
+        return;
+
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED,
+                     fileno(ai->file_handle), 0);
+    if (map == MAP_FAILED) {
+        LOG_F(INFO, "can't map archive %s, reading it through stdio",
+              (const char*) ai->file_name);
+        return;
+    }
+
+    ai->map_base = (const unsigned char*) map;
+    ai->map_length = st.st_size;
+#endif
+}
+
+
 int DirectReader::open(const pstring& name, int archive_type)
 {
     return 0;
@@ -322,30 +497,47 @@ FILE* DirectReader::getFileHandle(pstring filename, int& compression_type,
 }
 
 
-size_t DirectReader::getFileLength(const pstring& file_name)
+bool DirectReader::lookupFile(const pstring& file_name, FileRef& ref)
 {
-    int compression_type;
-    size_t len;
-    FILE* fp = getFileHandle(file_name, compression_type, &len);
-    if (fp) fclose(fp);
-    return len;
+    bool found = lookupLooseFile(file_name, ref);
+    countLookup(found ? &loose_stats : NULL);
+    return found;
 }
 
 
-size_t DirectReader::getFile(const pstring& file_name, unsigned char* buffer,
-			     int* location)
+bool DirectReader::lookupLooseFile(const pstring& file_name, FileRef& ref)
 {
-    int compression_type;
-    size_t len, c, total = 0;
-    FILE*  fp = getFileHandle(file_name, compression_type, &len);
+    ref.file_handle = getFileHandle(file_name, ref.compression_type,
+                                    &ref.length);
+    if (ref.file_handle && ref.length == 0) {
+        fclose(ref.file_handle);
+        ref.file_handle = NULL;
+    }
+    ref.location = ARCHIVE_TYPE_NONE;
+
+    return ref.file_handle != NULL;
+}
 
-    if (fp) {
-        if (compression_type & NBZ_COMPRESSION)
-	    return decodeNBZ(fp, 0, buffer);
-        else if (compression_type & SPB_COMPRESSION)
-	    return decodeSPB(fp, 0, buffer);
 
-        total = len;
+size_t DirectReader::readFile(FileRef& ref, unsigned char* buffer)
+{
+    FILE* fp = ref.file_handle;
+    if (!fp) return 0;
+
+    Uint64 begin = SDL_GetPerformanceCounter();
+    int type = NO_COMPRESSION;
+    size_t ret = ref.length;
+    if (ref.compression_type & NBZ_COMPRESSION) {
+        type = NBZ_COMPRESSION;
+        ret = decodeNBZ(fp, 0, buffer);
+    }
+    else if (ref.compression_type & SPB_COMPRESSION) {
+        type = SPB_COMPRESSION;
+        ret = decodeSPB(fp, 0, buffer);
+    }
+    else {
+        size_t len = ref.length, c;
+        fseek(fp, 0, SEEK_SET);
         while (len > 0) {
             if (len > READ_LENGTH) c = READ_LENGTH;
             else c = len;
@@ -354,11 +546,38 @@ size_t DirectReader::getFile(const pstring& file_name, unsigned char* buffer,
             fread(buffer, 1, c, fp);
             buffer += c;
         }
-        fclose(fp);
-        if (location) *location = ARCHIVE_TYPE_NONE;
     }
+    Uint64 ticks = SDL_GetPerformanceCounter() - begin;
 
-    return total;
+    size_t stored = ref.length;
+    if (type != NO_COMPRESSION) {
+        fseek(fp, 0, SEEK_END);
+        stored = ftell(fp);
+    }
+    countRead(loose_stats, type, stored, ret, ticks);
+
+    return ret;
+}
+
+
+size_t DirectReader::getFileLength(const pstring& file_name)
+{
+    FileRef ref;
+    lookupFile(file_name, ref);
+    return ref.length;
+}
+
+
+size_t DirectReader::getFile(const pstring& file_name, unsigned char* buffer,
+			     int* location)
+{
+    FileRef ref;
+    if (!lookupFile(file_name, ref)) return 0;
+
+    size_t ret = readFile(ref, buffer);
+    if (location) *location = ref.location;
+
+    return ret;
 }
 
 
@@ -426,28 +645,85 @@ size_t DirectReader::decodeNBZ(FILE* fp, size_t offset, unsigned char* buf)
 }
 
 
-int DirectReader::getbit(FILE* fp, int n)
+size_t DirectReader::decodeNBZ(const unsigned char* src, size_t src_len,
+                               unsigned char* buf) const
+{
+    if (key_table_flag)
+        LOG_F(INFO, "may not decode NBZ with key_table enabled.");
+
+    if (src_len < 4) return 0;
+
+    unsigned int original_length = key_table[src[0]];
+    original_length = original_length << 8 | key_table[src[1]];
+    original_length = original_length << 8 | key_table[src[2]];
+    original_length = original_length << 8 | key_table[src[3]];
+
+    bz_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (BZ2_bzDecompressInit(&strm, 0, 0) != BZ_OK) return 0;
+
+    strm.next_in   = (char*) src + 4;
+    strm.avail_in  = std::min(src_len - 4,
+                              (size_t) std::numeric_limits<unsigned int>::max());
+    strm.next_out  = (char*) buf;
+    strm.avail_out = original_length;
+
+    int err;
+    do {
+        err = BZ2_bzDecompress(&strm);
+    } while (err == BZ_OK && strm.avail_out > 0 && strm.avail_in > 0);
+
+    BZ2_bzDecompressEnd(&strm);
+
+    return original_length - strm.avail_out;
+}
+
+
+void DirectReader::initbit(BitReader& br, FILE* fp, size_t offset) const
+{
+    fseek(fp, offset, SEEK_SET);
+    br.fp   = fp;
+    br.ptr  = br.end = NULL;
+    br.mask = 0;
+    br.buf  = 0;
+}
+
+
+void DirectReader::initbit(BitReader& br, const unsigned char* src,
+                           size_t src_len) const
+{
+    br.fp   = NULL;
+    br.ptr  = src;
+    br.end  = src + src_len;
+    br.mask = 0;
+    br.buf  = 0;
+}
+
+
+int DirectReader::getbit(BitReader& br, int n) const
 {
     int i, x = 0;
-    static int getbit_buf;
 
     for (i = 0; i < n; i++) {
-        if (getbit_mask == 0) {
-            if (getbit_len == getbit_count) {
-                getbit_len = fread(read_buf, 1, READ_LENGTH, fp);
-                if (getbit_len == 0) return EOF;
+        if (br.mask == 0) {
+            if (br.ptr == br.end) {
+                if (!br.fp) return EOF;
+
+                size_t len = fread(br.read_buf, 1, READ_LENGTH, br.fp);
+                if (len == 0) return EOF;
 
-                getbit_count = 0;
+                br.ptr = br.read_buf;
+                br.end = br.read_buf + len;
             }
 
-            getbit_buf  = key_table[read_buf[getbit_count++]];
-            getbit_mask = 128;
+            br.buf  = key_table[*br.ptr++];
+            br.mask = 128;
         }
 
         x <<= 1;
-        if (getbit_buf & getbit_mask) x++;
+        if (br.buf & br.mask) x++;
 
-        getbit_mask >>= 1;
+        br.mask >>= 1;
     }
 
     return x;
@@ -455,18 +731,31 @@ int DirectReader::getbit(FILE* fp, int n)
 
 
 size_t DirectReader::decodeSPB(FILE* fp, size_t offset, unsigned char* buf)
+{
+    BitReader br;
+    initbit(br, fp, offset);
+    return decodeSPBSub(br, buf);
+}
+
+
+size_t DirectReader::decodeSPB(const unsigned char* src, size_t src_len,
+                               unsigned char* buf) const
+{
+    BitReader br;
+    initbit(br, src, src_len);
+    return decodeSPBSub(br, buf);
+}
+
+
+size_t DirectReader::decodeSPBSub(BitReader& br, unsigned char* buf) const
 {
     unsigned int   count;
     unsigned char* pbuf, * psbuf;
     size_t i, j, k;
     int c, n, m;
 
-    getbit_mask = 0;
-    getbit_len  = getbit_count = 0;
-
-    fseek(fp, offset, SEEK_SET);
-    size_t width  = readShort(fp);
-    size_t height = readShort(fp);
+    size_t width  = getbit(br, 16);
+    size_t height = getbit(br, 16);
 
     size_t width_pad = (4 - width * 3 % 4) % 4;
 
@@ -492,18 +781,13 @@ size_t DirectReader::decodeSPB(FILE* fp, size_t offset, unsigned char* buf)
 
     buf += 54;
 
-    if (decomp_buffer_len < width * height + 4) {
-        if (decomp_buffer) delete[] decomp_buffer;
-
-        decomp_buffer_len = width * height + 4;
-        decomp_buffer = new unsigned char[decomp_buffer_len];
-    }
+    std::vector<unsigned char> decomp_buffer(width * height + 4);
 
     for (i = 0; i < 3; i++) {
         count = 0;
-        decomp_buffer[count++] = c = getbit(fp, 8);
+        decomp_buffer[count++] = c = getbit(br, 8);
         while (count < (unsigned) (width * height)) {
-            n = getbit(fp, 3);
+            n = getbit(br, 3);
             if (n == 0) {
                 decomp_buffer[count++] = c;
                 decomp_buffer[count++] = c;
@@ -512,7 +796,7 @@ size_t DirectReader::decodeSPB(FILE* fp, size_t offset, unsigned char* buf)
                 continue;
             }
             else if (n == 7) {
-                m = getbit(fp, 1) + 1;
+                m = getbit(br, 1) + 1;
             }
             else {
                 m = n + 2;
@@ -520,10 +804,10 @@ size_t DirectReader::decodeSPB(FILE* fp, size_t offset, unsigned char* buf)
 
             for (j = 0; j < 4; j++) {
                 if (m == 8) {
-                    c = getbit(fp, 8);
+                    c = getbit(br, 8);
                 }
                 else {
-                    k = getbit(fp, m);
+                    k = getbit(br, m);
                     if (k & 1) c += (k >> 1) + 1;
                     else c -= (k >> 1);
                 }
@@ -533,7 +817,7 @@ size_t DirectReader::decodeSPB(FILE* fp, size_t offset, unsigned char* buf)
         }
 
         pbuf  = buf + (width * 3 + width_pad) * (height - 1) + i;
-        psbuf = decomp_buffer;
+        psbuf = &decomp_buffer[0];
 
         for (j = 0; j < height; j++) {
             if (j & 1) {
@@ -554,28 +838,49 @@ size_t DirectReader::decodeSPB(FILE* fp, size_t offset, unsigned char* buf)
 
 
 size_t DirectReader::decodeLZSS(ArchiveInfo* ai, int no, unsigned char* buf)
+{
+    size_t offset = ai->fi_list[no].offset;
+    if (ai->map_base && offset < ai->map_length)
+        return decodeLZSS(ai->map_base + offset, ai->map_length - offset,
+                          ai->fi_list[no].original_length, buf);
+
+    BitReader br;
+    initbit(br, ai->file_handle, offset);
+    return decodeLZSSSub(br, ai->fi_list[no].original_length, buf);
+}
+
+
+size_t DirectReader::decodeLZSS(const unsigned char* src, size_t src_len,
+                                size_t original_length,
+                                unsigned char* buf) const
+{
+    BitReader br;
+    initbit(br, src, src_len);
+    return decodeLZSSSub(br, original_length, buf);
+}
+
+
+size_t DirectReader::decodeLZSSSub(BitReader& br, size_t original_length,
+                                   unsigned char* buf) const
 {
     unsigned int count = 0;
     int i, j, k, r, c;
+    unsigned char decomp_buffer[N];
 
-    getbit_mask = 0;
-    getbit_len  = getbit_count = 0;
-
-    fseek(ai->file_handle, ai->fi_list[no].offset, SEEK_SET);
     memset(decomp_buffer, 0, N - F);
     r = N - F;
 
-    while (count < ai->fi_list[no].original_length) {
-        if (getbit(ai->file_handle, 1)) {
-            if ((c = getbit(ai->file_handle, 8)) == EOF) break;
+    while (count < original_length) {
+        if (getbit(br, 1)) {
+            if ((c = getbit(br, 8)) == EOF) break;
 
             buf[count++] = c;
             decomp_buffer[r++] = c;  r &= (N - 1);
         }
         else {
-            if ((i = getbit(ai->file_handle, EI)) == EOF) break;
+            if ((i = getbit(br, EI)) == EOF) break;
 
-            if ((j = getbit(ai->file_handle, EJ)) == EOF) break;
+            if ((j = getbit(br, EJ)) == EOF) break;
 
             for (k = 0; k <= j + 1; k++) {
                 c = decomp_buffer[(i + k) & (N - 1)];
@@ -589,6 +894,335 @@ size_t DirectReader::decodeLZSS(ArchiveInfo* ai, int no, unsigned char* buf)
 }
 
 
+// Decodes an archive entry held in memory.  Touches nothing but its
+// arguments and the key table, so it is safe on the async workers.
+size_t DirectReader::decodeEntry(int type, const unsigned char* src,
+                                 size_t src_len, size_t length,
+                                 unsigned char* buf) const
+{
+    if (type == NBZ_COMPRESSION)
+        return decodeNBZ(src, src_len, buf);
+    else if (type == LZSS_COMPRESSION)
+        return decodeLZSS(src, src_len, length, buf);
+    else if (type == SPB_COMPRESSION)
+        return decodeSPB(src, src_len, buf);
+
+    size_t ret = std::min(length, src_len);
+    for (size_t j = 0; j < ret; j++) buf[j] = key_table[src[j]];
+    return ret;
+}
+
+
+BaseReader::AsyncFile* DirectReader::getFileAsync(const pstring& file_name)
+{
+    AsyncFile* file = new AsyncFile;
+
+    FileRef ref;
+    if (!lookupFile(file_name, ref)) {
+        file->finish();
+        return file;
+    }
+    file->location = ref.location;
+
+    // Threads are started on first use, leaving one core for the
+    // caller where there are cores to spare.
+    if (async_threads.empty()) {
+        int n = std::max(1, std::min(SDL_GetCPUCount() - 1,
+                                     ASYNC_READ_THREADS));
+        for (int i = 0; i < n; i++) {
+            SDL_Thread* thread =
+                SDL_CreateThread(asyncWorker, "DirectReader", this);
+            if (thread) async_threads.push_back(thread);
+        }
+    }
+
+    // Loose files are read here; they are rarely compressed.  Archive
+    // entries are decoded by the workers, straight from the mapping if
+    // there is one, since the archive's FILE* can't be shared.
+    if (!ref.ai || async_threads.empty()) {
+        file->data = BaseReader::readFile(ref);
+        file->finish();
+        return file;
+    }
+
+    const FileInfo& fi = ref.ai->fi_list[ref.no];
+    if (ref.ai->map_base && fi.offset < ref.ai->map_length) {
+        file->src = ref.ai->map_base + fi.offset;
+        file->src_len = ref.ai->map_length - fi.offset;
+    }
+    else {
+        file->raw = pstring('\0', fi.length);
+        fseek(ref.ai->file_handle, fi.offset, SEEK_SET);
+        file->src_len = fread(file->raw.mutable_data(), 1, fi.length,
+                              ref.ai->file_handle);
+        file->src = (const unsigned char*) (const char*) file->raw;
+    }
+    file->compression_type = ref.compression_type;
+    file->length = ref.length;
+    file->stats = &ref.ai->stats;
+
+    SDL_LockMutex(async_lock);
+    async_queue.push_back(file);
+    ++async_busy;
+    SDL_CondSignal(async_ready);
+    SDL_UnlockMutex(async_lock);
+
+    return file;
+}
+
+
+void DirectReader::waitAsync()
+{
+    SDL_LockMutex(async_lock);
+    while (async_busy > 0)
+        SDL_CondWait(async_idle, async_lock);
+    SDL_UnlockMutex(async_lock);
+}
+
+
+int DirectReader::asyncWorker(void* data)
+{
+    ((DirectReader*) data)->runAsync();
+    return 0;
+}
+
+
+void DirectReader::runAsync()
+{
+    SDL_LockMutex(async_lock);
+    for (;;) {
+        while (!async_quit && async_queue.empty())
+            SDL_CondWait(async_ready, async_lock);
+        if (async_quit) break;
+
+        AsyncFile* file = async_queue.front();
+        async_queue.pop_front();
+        SDL_UnlockMutex(async_lock);
+
+        Uint64 begin = SDL_GetPerformanceCounter();
+        unsigned char* buf = new unsigned char[file->length];
+        size_t len = decodeEntry(file->compression_type, file->src,
+                                 file->src_len, file->length, buf);
+        file->data = pstring(buf, len);
+        delete[] buf;
+        if (file->stats)
+            countRead(*file->stats, file->compression_type,
+                      std::min(file->src_len, file->length), len,
+                      SDL_GetPerformanceCounter() - begin);
+        file->raw = pstring();
+        file->finish();
+
+        SDL_LockMutex(async_lock);
+        if (--async_busy == 0) SDL_CondBroadcast(async_idle);
+    }
+    SDL_UnlockMutex(async_lock);
+}
+
+
+// State behind an SDL_RWops from openStream().  Archive entries are
+// read with a FILE* of the stream's own rather than from the reader's
+// handle or mapping, so the stream can be read on the audio thread and
+// outlive the reader.
+struct EntryStream {
+    FILE* fp;                 // NULL when reading from data
+    pstring data;             // the whole file, for compressed entries
+    size_t offset, length, pos;
+    bool scrambled;
+    unsigned char key_table[256];
+    unsigned char buf[STREAM_BUFFER_LENGTH];
+    size_t buf_start, buf_len; // part of the entry held in buf
+};
+
+
+static Sint64 streamSize(SDL_RWops* rw)
+{
+    return ((EntryStream*) rw->hidden.unknown.data1)->length;
+}
+
+
+static Sint64 streamSeek(SDL_RWops* rw, Sint64 offset, int whence)
+{
+    EntryStream* s = (EntryStream*) rw->hidden.unknown.data1;
+
+    Sint64 pos = offset;
+    if (whence == RW_SEEK_CUR) pos += s->pos;
+    else if (whence == RW_SEEK_END) pos += s->length;
+    if (pos < 0 || pos > (Sint64) s->length)
+        return SDL_SetError("Seek outside of archive entry");
+
+    s->pos = pos;
+    return pos;
+}
+
+
+static size_t streamRead(SDL_RWops* rw, void* ptr, size_t size,
+                         size_t maxnum)
+{
+    EntryStream* s = (EntryStream*) rw->hidden.unknown.data1;
+    if (size == 0) return 0;
+
+    size_t len = std::min(maxnum, (s->length - s->pos) / size) * size;
+    unsigned char* dst = (unsigned char*) ptr;
+    size_t done = 0;
+
+    if (!s->fp) {
+        memcpy(dst, (const char*) s->data + s->pos, len);
+        done = len;
+    }
+    while (done < len) {
+        size_t pos = s->pos + done;
+        if (pos >= s->buf_start && pos < s->buf_start + s->buf_len) {
+            size_t c = std::min(len - done, s->buf_start + s->buf_len - pos);
+            memcpy(dst + done, s->buf + (pos - s->buf_start), c);
+            done += c;
+            continue;
+        }
+
+        // Large reads skip the buffer; small ones refill it.
+        fseek(s->fp, s->offset + pos, SEEK_SET);
+        size_t c;
+        if (len - done >= STREAM_BUFFER_LENGTH) {
+            c = fread(dst + done, 1, len - done, s->fp);
+            done += c;
+        }
+        else {
+            s->buf_start = pos;
+            s->buf_len = c = fread(s->buf, 1, std::min((size_t) STREAM_BUFFER_LENGTH,
+                                                       s->length - pos), s->fp);
+        }
+        if (c == 0) break;
+    }
+
+    if (s->scrambled)
+        for (size_t i = 0; i < done; i++) dst[i] = s->key_table[dst[i]];
+
+    s->pos += done;
+    return done / size;
+}
+
+
+static size_t streamWrite(SDL_RWops* rw, const void* ptr, size_t size,
+                          size_t num)
+{
+    SDL_SetError("Archive entries are read-only");
+    return 0;
+}
+
+
+static int streamClose(SDL_RWops* rw)
+{
+    EntryStream* s = (EntryStream*) rw->hidden.unknown.data1;
+    if (s->fp) fclose(s->fp);
+    delete s;
+    SDL_FreeRW(rw);
+    return 0;
+}
+
+
+SDL_RWops* DirectReader::openStream(const pstring& file_name)
+{
+    FileRef ref;
+    if (!lookupFile(file_name, ref)) return NULL;
+
+    EntryStream* s = new EntryStream;
+    s->fp = NULL;
+    s->offset = s->pos = 0;
+    s->length = ref.length;
+    s->scrambled = false;
+    s->buf_start = s->buf_len = 0;
+
+    if (ref.compression_type != NO_COMPRESSION) {
+        s->data = BaseReader::readFile(ref);
+        s->length = s->data.length();
+    }
+    else if (!ref.ai) {
+        // A loose file: keep the handle lookupFile opened.
+        s->fp = ref.file_handle;
+        ref.file_handle = NULL;
+        countRead(loose_stats, NO_COMPRESSION, s->length, s->length, 0);
+    }
+    else {
+        const FileInfo& fi = ref.ai->fi_list[ref.no];
+        s->offset = fi.offset;
+        s->length = fi.length;
+        s->scrambled = key_table_flag;
+        memcpy(s->key_table, key_table, 256);
+
+        // Reopen the file the archive was indexed from, not whatever
+        // its name finds now.
+        s->fp = fopen(ref.ai->open_path, "rb");
+        if (!s->fp) {
+            delete s;
+            return NULL;
+        }
+        countRead(ref.ai->stats, NO_COMPRESSION, s->length, s->length, 0);
+    }
+
+    SDL_RWops* rw = SDL_AllocRW();
+    if (!rw) {
+        if (s->fp) fclose(s->fp);
+        delete s;
+        return NULL;
+    }
+    rw->size  = streamSize;
+    rw->seek  = streamSeek;
+    rw->read  = streamRead;
+    rw->write = streamWrite;
+    rw->close = streamClose;
+    rw->type  = SDL_RWOPS_UNKNOWN;
+    rw->hidden.unknown.data1 = s;
+
+    return rw;
+}
+
+
+void DirectReader::countLookup(IOStats* stats)
+{
+    SDL_LockMutex(stats_lock);
+    if (stats) ++stats->lookups;
+    else ++lookup_misses;
+    SDL_UnlockMutex(stats_lock);
+}
+
+
+void DirectReader::countRead(IOStats& stats, int type, size_t stored,
+                             size_t decoded, Uint64 ticks)
+{
+    SDL_LockMutex(stats_lock);
+    stats.addRead(type, stored, decoded, ticks);
+    SDL_UnlockMutex(stats_lock);
+}
+
+
+bool DirectReader::getIOStats(int index, pstring& name, IOStats& stats)
+{
+    const IOStats* src = &loose_stats;
+    name = "(loose files)";
+    if (index < 0) return false;
+    if (index > 0) {
+        ArchiveInfo* ai = getArchiveInfo(index - 1);
+        if (!ai) return false;
+        src = &ai->stats;
+        name = ai->file_name;
+    }
+
+    SDL_LockMutex(stats_lock);
+    stats = *src;
+    SDL_UnlockMutex(stats_lock);
+
+    return true;
+}
+
+
+Uint64 DirectReader::getLookupMisses()
+{
+    SDL_LockMutex(stats_lock);
+    Uint64 ret = lookup_misses;
+    SDL_UnlockMutex(stats_lock);
+    return ret;
+}
+
+
 size_t DirectReader::getDecompressedFileLength(int type, FILE* fp, size_t offset)
 {
     fpos_t pos;
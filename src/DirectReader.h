@@ -30,6 +30,9 @@
 #include "DirPaths.h"
 
 #define MAX_FILE_NAME_LENGTH 256
+#define READ_LENGTH 4096
+#define ASYNC_READ_THREADS 4 // at most; fewer on small machines
+#define STREAM_BUFFER_LENGTH (READ_LENGTH * 4)
 
 class DirectReader : public BaseReader {
 public:
@@ -44,9 +47,15 @@ public:
     void registerCompressionType(const pstring& ext, int type);
 
     FileInfo getFileByIndex(unsigned int index);
+    bool lookupFile(const pstring& file_name, FileRef& ref);
+    size_t readFile(FileRef& ref, unsigned char* buffer);
     size_t getFileLength(const pstring& file_name);
     size_t getFile(const pstring& file_name, unsigned char* buffer,
                    int* location = NULL);
+    AsyncFile* getFileAsync(const pstring& file_name);
+    SDL_RWops* openStream(const pstring& file_name);
+    bool getIOStats(int index, pstring& name, IOStats& stats);
+    Uint64 getLookupMisses();
 
 //    static string convertFromSJISToEUC(string buf);
     static pstring convertFromSJISToUTF8(const pstring& src);
@@ -55,11 +64,15 @@ protected:
     DirPaths *archive_path;
     unsigned char key_table[256];
     bool   key_table_flag;
-    int    getbit_mask;
-    size_t getbit_len, getbit_count;
-    unsigned char* read_buf;
-    unsigned char* decomp_buffer;
-    size_t decomp_buffer_len;
+
+    // Position in a compressed bit stream.  Each decode keeps its own,
+    // so decoders working from memory can run on several threads.
+    struct BitReader {
+        FILE* fp;
+        const unsigned char* ptr, * end;
+        int mask, buf;
+        unsigned char read_buf[READ_LENGTH];
+    };
 
     // TODO: replace with map
     struct RegisteredCompressionType {
@@ -78,19 +91,93 @@ protected:
         };
     } root_registered_compression_type, *last_registered_compression_type;
 
-    FILE* fileopen(pstring path, const char* mode);
+#if !defined (WIN32) && !defined (PSP) && !defined (__OS2__)
+    // Contents of a directory keyed on the lowercased entry name, so
+    // fileopen can correct the case of a path without rescanning the
+    // directory.  A listing is reread when the directory's mtime changes,
+    // or, where mtimes only count seconds, once it is MISSING_FILE_TTL old.
+    struct DirListing {
+        time_t mtime;
+        long mtime_nsec;
+        Uint32 ticks; // SDL_GetTicks() when read
+        std::unordered_map<pstring, pstring, pstring_hash> entries;
+    };
+    std::unordered_map<pstring, DirListing, pstring_hash> dir_cache;
+
+    const DirListing* getDirListing(const pstring& dir);
+#endif
+
+    // Names fileopen recently failed to find, keyed on the mode and the
+    // name.  These fail straight away until the entry expires or one of
+    // the directories searched for it changes.
+    struct MissingFile {
+        Uint32 ticks;     // SDL_GetTicks() time of the failure
+        Uint64 dir_stamp; // searchDirStamp() at the time
+    };
+    std::unordered_map<pstring, MissingFile, pstring_hash> missing_files;
+
+    Uint64 searchDirStamp(const pstring& path);
+
+    // I/O counters; see BaseReader::IOStats.  Updated under
+    // stats_lock, as getFileAsync decodes are counted by the workers.
+    IOStats loose_stats;
+    Uint64 lookup_misses;
+    SDL_mutex* stats_lock;
+
+    void countLookup(IOStats* stats); // NULL for a miss
+    void countRead(IOStats& stats, int type, size_t stored, size_t decoded,
+                   Uint64 ticks);
+
+    // The archives a reader has open, in search order, for getIOStats.
+    virtual ArchiveInfo* getArchiveInfo(int index) { return NULL; }
+
+    // lookupFile without the counting, for readers that extend it.
+    bool lookupLooseFile(const pstring& file_name, FileRef& ref);
+
+    // opened_path, if given, is set to the path the file was found at.
+    FILE* fileopen(pstring path, const char* mode, pstring* opened_path = NULL);
     unsigned char readChar(FILE* fp);
     unsigned short readShort(FILE* fp);
     unsigned long readLong(FILE* fp);
+    void mapArchive(ArchiveInfo* ai);
     size_t decodeNBZ(FILE* fp, size_t offset, unsigned char* buf);
-    int getbit(FILE* fp, int n);
+    size_t decodeNBZ(const unsigned char* src, size_t src_len,
+                     unsigned char* buf) const;
+    void initbit(BitReader& br, FILE* fp, size_t offset) const;
+    void initbit(BitReader& br, const unsigned char* src,
+                 size_t src_len) const;
+    int getbit(BitReader& br, int n) const;
     size_t decodeSPB(FILE* fp, size_t offset, unsigned char* buf);
+    size_t decodeSPB(const unsigned char* src, size_t src_len,
+                     unsigned char* buf) const;
     size_t decodeLZSS(ArchiveInfo* ai, int no, unsigned char* buf);
+    size_t decodeLZSS(const unsigned char* src, size_t src_len,
+                      size_t original_length, unsigned char* buf) const;
+    size_t decodeEntry(int type, const unsigned char* src, size_t src_len,
+                       size_t length, unsigned char* buf) const;
     int getRegisteredCompressionType(pstring filename);
     size_t getDecompressedFileLength(int type, FILE* fp, size_t offset);
 
+    // Blocks until every getFileAsync request has been decoded; called
+    // before archives are unmapped.
+    void waitAsync();
+
 private:
+    size_t decodeSPBSub(BitReader& br, unsigned char* buf) const;
+    size_t decodeLZSSSub(BitReader& br, size_t original_length,
+                         unsigned char* buf) const;
     FILE* getFileHandle(pstring filename, int& compression_type, size_t* length);
+
+    std::vector<SDL_Thread*> async_threads;
+    SDL_mutex* async_lock;
+    SDL_cond* async_ready;
+    SDL_cond* async_idle;
+    std::deque<AsyncFile*> async_queue;
+    int async_busy; // requests queued or being decoded
+    bool async_quit;
+
+    static int asyncWorker(void* data);
+    void runAsync();
 };
 
 #endif // __DIRECT_READER_H__
@@ -112,6 +112,7 @@ Font* FontsStruct::font(int style)
 
     while ((fp == NULL) && (n<path->get_num_paths())) {
         pstring curpath = path->get_path(n++);
+        BaseReader::FileRef ref;
 
         pstring fpath = curpath + mapping[style];
         fp = fopen(fpath, "rb");
@@ -147,14 +148,17 @@ Font* FontsStruct::font(int style)
                 }
                 font_[style] = new Font(fpath, metnam);
             }
-            else if ((len = ScriptHandler::cBR->getFileLength(mapping[style]))) {
+            else if (ScriptHandler::cBR->lookupFile(mapping[style], ref)) {
+                len = ref.length;
                 Uint8 *data = new Uint8[len], *mdat = NULL;
-                ScriptHandler::cBR->getFile(mapping[style], data);
+                ScriptHandler::cBR->readFile(ref, data);
                 size_t mlen = 0;
+                BaseReader::FileRef mref;
                 if (metrics[style] &&
-                    (mlen = ScriptHandler::cBR->getFileLength(metrics[style]))) {
+                    ScriptHandler::cBR->lookupFile(metrics[style], mref)) {
+                    mlen = mref.length;
                     mdat = new Uint8[mlen];
-                    ScriptHandler::cBR->getFile(metrics[style], mdat);
+                    ScriptHandler::cBR->readFile(mref, mdat);
                 }
 
                 font_[style] = new Font(data, len, mdat, mlen);
@@ -0,0 +1,88 @@
+/* -*- C++ -*-
+ *
+ *  ImageCache.cpp - LRU cache of decoded images
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "ImageCache.h"
+
+ImageCache::ImageCache(size_t max_bytes)
+    : hits(0), misses(0), evictions(0),
+      max_bytes(max_bytes), total_bytes(0)
+{}
+
+
+ImageCache::~ImageCache()
+{
+    clear();
+}
+
+
+SDL_Surface* ImageCache::get(const pstring& key, bool* has_alpha)
+{
+    std::unordered_map<pstring, entry_list_t::iterator, pstring_hash>::iterator
+        it = index.find(key);
+    if (it == index.end()) {
+        ++misses;
+        return NULL;
+    }
+
+    ++hits;
+    entries.splice(entries.begin(), entries, it->second);
+
+    Entry& entry = *it->second;
+    if (has_alpha) *has_alpha = entry.has_alpha;
+    entry.surface->refcount++;
+    return entry.surface;
+}
+
+
+void ImageCache::add(const pstring& key, SDL_Surface* surface, bool has_alpha)
+{
+    size_t bytes = (size_t) surface->pitch * surface->h;
+    if (bytes > max_bytes / 4) return; // would just flush everything else
+
+    std::unordered_map<pstring, entry_list_t::iterator, pstring_hash>::iterator
+        it = index.find(key);
+    if (it != index.end()) evict(it->second);
+
+    while (!entries.empty() && total_bytes + bytes > max_bytes) {
+        evict(--entries.end());
+        ++evictions;
+    }
+
+    Entry entry = { key, surface, has_alpha, bytes };
+    surface->refcount++;
+    entries.push_front(entry);
+    index[key] = entries.begin();
+    total_bytes += bytes;
+}
+
+
+void ImageCache::clear()
+{
+    while (!entries.empty())
+        evict(entries.begin());
+}
+
+
+void ImageCache::evict(entry_list_t::iterator it)
+{
+    total_bytes -= it->bytes;
+    SDL_FreeSurface(it->surface);
+    index.erase(it->key);
+    entries.erase(it);
+}
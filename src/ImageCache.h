@@ -0,0 +1,64 @@
+/* -*- C++ -*-
+ *
+ *  ImageCache.h - LRU cache of decoded images
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __IMAGE_CACHE_H__
+#define __IMAGE_CACHE_H__
+
+#include "defs.h"
+#include <SDL.h>
+#include <list>
+
+// Holds converted surfaces returned by PonscripterLabel::loadImage, so
+// an image that is loaded again with the same options skips the
+// archive read and decode.  Surfaces are shared by reference count:
+// get() hands out an extra reference which the caller releases with
+// SDL_FreeSurface as usual, so callers must not modify the pixels.
+class ImageCache {
+public:
+    ImageCache(size_t max_bytes);
+    ~ImageCache();
+
+    SDL_Surface* get(const pstring& key, bool* has_alpha);
+    void add(const pstring& key, SDL_Surface* surface, bool has_alpha);
+    void clear();
+    bool contains(const pstring& key) const { return index.count(key) != 0; }
+
+    size_t size() const { return entries.size(); }
+    size_t bytes() const { return total_bytes; }
+    size_t maxBytes() const { return max_bytes; }
+
+    unsigned long hits, misses, evictions;
+
+private:
+    struct Entry {
+        pstring key;
+        SDL_Surface* surface;
+        bool has_alpha;
+        size_t bytes;
+    };
+    typedef std::list<Entry> entry_list_t;
+
+    entry_list_t entries; // most recently used first
+    std::unordered_map<pstring, entry_list_t::iterator, pstring_hash> index;
+    size_t max_bytes, total_bytes;
+
+    void evict(entry_list_t::iterator it);
+};
+
+#endif // __IMAGE_CACHE_H__
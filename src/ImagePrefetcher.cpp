@@ -0,0 +1,217 @@
+/* -*- C++ -*-
+ *
+ *  ImagePrefetcher.cpp - background decoding of upcoming images
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "ImagePrefetcher.h"
+#include <algorithm>
+#include <loguru.hpp>
+
+template <class T>
+static typename T::iterator findJob(T& jobs, const pstring& key)
+{
+    typename T::iterator it = jobs.begin();
+    while (it != jobs.end() && (*it)->key != key) ++it;
+    return it;
+}
+
+
+ImagePrefetcher::ImagePrefetcher(decode_t decode, int max_threads)
+    : decode(decode), max_threads(max_threads), quit(false)
+{
+    lock = SDL_CreateMutex();
+    work_ready = SDL_CreateCond();
+    job_done = SDL_CreateCond();
+}
+
+
+ImagePrefetcher::~ImagePrefetcher()
+{
+    clear();
+
+    SDL_LockMutex(lock);
+    quit = true;
+    SDL_CondBroadcast(work_ready);
+    SDL_UnlockMutex(lock);
+
+    for (size_t i = 0; i < threads.size(); i++)
+        SDL_WaitThread(threads[i], NULL);
+
+    SDL_DestroyCond(job_done);
+    SDL_DestroyCond(work_ready);
+    SDL_DestroyMutex(lock);
+}
+
+
+bool ImagePrefetcher::pending(const pstring& key)
+{
+    SDL_LockMutex(lock);
+    bool ret = findJob(queued, key) != queued.end()
+            || findJob(reading, key) != reading.end()
+            || findJob(running, key) != running.end()
+            || findJob(finished, key) != finished.end();
+    SDL_UnlockMutex(lock);
+    return ret;
+}
+
+
+void ImagePrefetcher::add(Job* job)
+{
+    // Threads are started on first use, leaving one core for the
+    // main thread where there are cores to spare.
+    if (threads.empty() && max_threads > 0) {
+        int n = std::max(1, std::min(SDL_GetCPUCount() - 1, max_threads));
+        for (int i = 0; i < n; i++) {
+            SDL_Thread* thread =
+                SDL_CreateThread(worker, "ImagePrefetcher", this);
+            if (thread) threads.push_back(thread);
+        }
+        if (threads.empty()) {
+            LOG_F(WARNING, "Could not start image prefetch: %s",
+                  SDL_GetError());
+            max_threads = 0;
+        }
+    }
+    if (threads.empty()) {
+        delete job;
+        return;
+    }
+
+    SDL_LockMutex(lock);
+    queued.push_back(job);
+    SDL_CondSignal(work_ready);
+    SDL_UnlockMutex(lock);
+}
+
+
+ImagePrefetcher::Job* ImagePrefetcher::take(const pstring& key)
+{
+    Job* ret = NULL;
+
+    SDL_LockMutex(lock);
+    std::deque<Job*>::iterator it = findJob(queued, key);
+    std::vector<Job*>::iterator reader = findJob(reading, key);
+    if (it != queued.end()) {
+        delete *it;
+        queued.erase(it);
+    }
+    else if (reader != reading.end()) {
+        // The worker deletes it once the read finishes.
+        (*reader)->dropped = true;
+    }
+    else {
+        while (findJob(running, key) != running.end())
+            SDL_CondWait(job_done, lock);
+
+        it = findJob(finished, key);
+        if (it != finished.end()) {
+            ret = *it;
+            finished.erase(it);
+        }
+    }
+    SDL_UnlockMutex(lock);
+
+    return ret;
+}
+
+
+ImagePrefetcher::Job* ImagePrefetcher::collect()
+{
+    Job* ret = NULL;
+
+    SDL_LockMutex(lock);
+    if (!finished.empty()) {
+        ret = finished.front();
+        finished.pop_front();
+    }
+    SDL_UnlockMutex(lock);
+
+    return ret;
+}
+
+
+void ImagePrefetcher::cancel()
+{
+    SDL_LockMutex(lock);
+    while (!queued.empty()) {
+        delete queued.front();
+        queued.pop_front();
+    }
+    for (size_t i = 0; i < reading.size(); i++)
+        reading[i]->dropped = true;
+    SDL_UnlockMutex(lock);
+}
+
+
+void ImagePrefetcher::clear()
+{
+    SDL_LockMutex(lock);
+    while (!queued.empty()) {
+        delete queued.front();
+        queued.pop_front();
+    }
+    while (!reading.empty() || !running.empty())
+        SDL_CondWait(job_done, lock);
+    while (!finished.empty()) {
+        delete finished.front();
+        finished.pop_front();
+    }
+    SDL_UnlockMutex(lock);
+}
+
+
+int ImagePrefetcher::worker(void* data)
+{
+    ((ImagePrefetcher*) data)->run();
+    return 0;
+}
+
+
+void ImagePrefetcher::run()
+{
+    SDL_LockMutex(lock);
+    for (;;) {
+        while (!quit && queued.empty())
+            SDL_CondWait(work_ready, lock);
+        if (quit) break;
+
+        Job* job = queued.front();
+        queued.pop_front();
+        reading.push_back(job);
+        SDL_UnlockMutex(lock);
+
+        if (job->file) job->file->wait();
+
+        SDL_LockMutex(lock);
+        reading.erase(std::find(reading.begin(), reading.end(), job));
+        if (job->dropped) {
+            delete job;
+            SDL_CondBroadcast(job_done);
+            continue;
+        }
+        running.push_back(job);
+        SDL_UnlockMutex(lock);
+
+        decode(*job);
+
+        SDL_LockMutex(lock);
+        running.erase(std::find(running.begin(), running.end(), job));
+        finished.push_back(job);
+        SDL_CondBroadcast(job_done);
+    }
+    SDL_UnlockMutex(lock);
+}
@@ -0,0 +1,99 @@
+/* -*- C++ -*-
+ *
+ *  ImagePrefetcher.h - background decoding of upcoming images
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __IMAGE_PREFETCHER_H__
+#define __IMAGE_PREFETCHER_H__
+
+#include "defs.h"
+#include "BaseReader.h"
+#include <SDL.h>
+#include <deque>
+
+// Runs PonscripterLabel's image decode on a small pool of threads, so
+// images named by upcoming script commands are ready before loadImage
+// asks for them.  The main thread looks the file up and hands it over
+// in a Job, either as a view of a mapped archive or as a read started
+// with getFileAsync; the workers only ever touch the Job they are given.
+class ImagePrefetcher {
+public:
+    struct Job {
+        pstring key;      // image cache key
+        pstring filename;
+        BaseReader::AsyncFile* file; // contents, unless view is set
+        const unsigned char* view;
+        size_t length;
+        SDL_PixelFormat format; // a copy, as the screen may be recreated
+        bool want_alpha, twox, isflipped;
+        int res_multiplier, png_mask_type;
+
+        SDL_Surface* surface; // set by the worker; NULL on failure
+        bool has_alpha;
+        bool dropped; // taken while its file was still being read
+
+        Job() : file(NULL), view(NULL), length(0), format(), want_alpha(false),
+                twox(false), isflipped(false), res_multiplier(1),
+                png_mask_type(0), surface(NULL), has_alpha(false),
+                dropped(false) {}
+        ~Job() {
+            delete file;
+            if (surface) SDL_FreeSurface(surface);
+        }
+    };
+    typedef void (*decode_t)(Job& job);
+
+    ImagePrefetcher(decode_t decode, int max_threads);
+    ~ImagePrefetcher();
+
+    // True if a job for key is queued, running or waiting collection.
+    bool pending(const pstring& key);
+    void add(Job* job);
+
+    // Removes the job for key and returns it once decoded, waiting if
+    // a worker is decoding it.  A job not yet decoding, whether queued
+    // or waiting for its file, is dropped and NULL returned, as decoding
+    // it inline is quicker than waiting.
+    Job* take(const pstring& key);
+
+    // Returns a finished job, or NULL if there are none.
+    Job* collect();
+
+    // Drops the jobs not yet decoding, as take() does, leaving running
+    // and finished ones be.
+    void cancel();
+
+    // Drops queued and finished jobs and waits for running ones.
+    void clear();
+
+private:
+    decode_t decode;
+    int max_threads;
+    std::vector<SDL_Thread*> threads;
+    SDL_mutex* lock;
+    SDL_cond* work_ready;
+    SDL_cond* job_done;
+    bool quit;
+
+    std::deque<Job*> queued, finished;
+    std::vector<Job*> reading, running; // reading: waiting for job->file
+
+    static int worker(void* data);
+    void run();
+};
+
+#endif // __IMAGE_PREFETCHER_H__
@@ -45,6 +45,7 @@ static inline unsigned short MadFixedToUshort(mad_fixed_t Fixed)
 
 struct _MAD_WRAPPER {
     SDL_RWops* src;
+    int freesrc;
     Uint32 length;
     struct mad_stream Stream;
     struct mad_frame Frame;
@@ -59,7 +60,7 @@ struct _MAD_WRAPPER {
 
 typedef struct _MAD_WRAPPER MAD_WRAPPER;
 
-static MAD_WRAPPER* init(SDL_RWops* src)
+static MAD_WRAPPER* init(SDL_RWops* src, int freesrc)
 {
     MAD_WRAPPER* mad = new MAD_WRAPPER;
 
@@ -68,6 +69,7 @@ static MAD_WRAPPER* init(SDL_RWops* src)
     SDL_RWseek(src, 0, SEEK_SET);
 
     mad->src = src;
+    mad->freesrc = freesrc;
 
     mad_stream_init(&mad->Stream);
     mad_frame_init(&mad->Frame);
@@ -91,13 +93,14 @@ MAD_WRAPPER* MAD_WRAPPER_new(const char* file, void* info, int sdl_audio)
     src = SDL_RWFromFile(file, "rb");
     if (!src) return NULL;
 
-    return init(src);
+    return init(src, 1);
 }
 
 
-MAD_WRAPPER* MAD_WRAPPER_new_rwops(SDL_RWops* src, void* info, int sdl_audio)
+MAD_WRAPPER* MAD_WRAPPER_new_rwops(SDL_RWops* src, void* info, int freesrc,
+                                   int sdl_audio)
 {
-    return init(src);
+    return init(src, freesrc);
 }
 
 
@@ -225,7 +228,7 @@ void MAD_WRAPPER_delete(MAD_WRAPPER* mad)
 
     delete[] mad->input_buf;
     delete[] mad->output_buf;
-    SDL_FreeRW(mad->src);
+    if (mad->freesrc) SDL_RWclose(mad->src);
     delete mad;
 }
 
@@ -35,7 +35,8 @@
 typedef struct _MAD_WRAPPER MAD_WRAPPER;
 
 MAD_WRAPPER* MAD_WRAPPER_new(const char* file, void* info, int sdl_audio);
-MAD_WRAPPER* MAD_WRAPPER_new_rwops(SDL_RWops* src, void* info, int sdl_audio);
+MAD_WRAPPER* MAD_WRAPPER_new_rwops(SDL_RWops* src, void* info, int freesrc,
+                                  int sdl_audio);
 int MAD_WRAPPER_playAudio(void* userdata, Uint8* stream, int len);
 void MAD_WRAPPER_stop(MAD_WRAPPER* mad);
 void MAD_WRAPPER_play(MAD_WRAPPER* mad);
@@ -36,7 +36,9 @@ NsaReader::NsaReader(DirPaths *path, const unsigned char* key_table)
 
 
 NsaReader::~NsaReader()
-{ }
+{
+    waitAsync();
+}
 
 
 int NsaReader::open(const pstring& nsa_path, int archive_type)
@@ -66,11 +68,15 @@ int NsaReader::open(const pstring& nsa_path, int archive_type)
             if (i < 0) {
                 archive_info.file_handle = fp;
                 archive_info.file_name = archive_name2;
-                readArchive(&archive_info, archive_type);
+                archive_info.open_path = archive_name2;
+                loadArchive(&archive_info, archive_type);
+                mapArchive(&archive_info);
             } else {
                 archive_info2[i].file_handle = fp;
                 archive_info2[i].file_name = archive_name2;
-                readArchive(&archive_info2[i], archive_type);
+                archive_info2[i].open_path = archive_name2;
+                loadArchive(&archive_info2[i], archive_type);
+                mapArchive(&archive_info2[i]);
             }
             i++;
             j++;
@@ -80,6 +86,13 @@ int NsaReader::open(const pstring& nsa_path, int archive_type)
         }
     }
 
+    // With arc.sar present, lookups only ever consult the SAR archive.
+    if (!sar_flag && i >= 0) {
+        addToIndex(&archive_info, ARCHIVE_TYPE_NSA);
+        for (j = 0; j < i; j++)
+            addToIndex(&archive_info2[j], ARCHIVE_TYPE_NSA);
+    }
+
     if (i < 0) {
         // didn't find any (main) archive files
         LOG_F(INFO, "can't open archive file %s", (const char*) archive_name);
@@ -102,72 +115,18 @@ int NsaReader::getNumFiles()
 }
 
 
-size_t NsaReader::getFileLengthSub(ArchiveInfo* ai, const pstring& file_name)
-{
-    unsigned int i = getIndexFromFile(ai, file_name);
-
-    if (i == ai->num_of_files) return 0;
-
-    if ( ai->fi_list[i].original_length != 0 ){
-        return ai->fi_list[i].original_length;
-    }
-
-    int type = ai->fi_list[i].compression_type;
-    if ( type == NO_COMPRESSION )
-        type = getRegisteredCompressionType( file_name );
-    if ( type == NBZ_COMPRESSION || type == SPB_COMPRESSION ) {
-        ai->fi_list[i].original_length = getDecompressedFileLength( type, ai->file_handle, ai->fi_list[i].offset );
-    }
-
-    return ai->fi_list[i].original_length;
-}
-
-
-size_t NsaReader::getFileLength(const pstring& file_name)
-{
-    if (sar_flag) return SarReader::getFileLength(file_name);
-
-    size_t ret;
-    int i;
-
-    if ((ret = DirectReader::getFileLength(file_name))) return ret;
-
-    if ((ret = getFileLengthSub(&archive_info, file_name))) return ret;
-
-    for (i = 0; i < num_of_nsa_archives; i++) {
-        if ((ret = getFileLengthSub(&archive_info2[i], file_name))) return ret;
-    }
-
-    return 0;
-}
-
-
-size_t NsaReader::getFile(const pstring& file_name, unsigned char* buffer,
-			  int* location)
+NsaReader::ArchiveInfo* NsaReader::getArchiveInfo(int index)
 {
-    size_t ret;
+    // SAR archives are searched first, then arc.nsa and arc1..9.nsa.
+    if (index < num_of_sar_archives)
+        return SarReader::getArchiveInfo(index);
 
-    if (sar_flag)
-	return SarReader::getFile(file_name, buffer, location);
-
-    if ((ret = DirectReader::getFile(file_name, buffer, location)))
-	return ret;
-
-    if ((ret = getFileSub(&archive_info, file_name, buffer))) {
-        if (location) *location = ARCHIVE_TYPE_NSA;
-
-        return ret;
-    }
-
-    for (int i = 0; i < num_of_nsa_archives; i++) {
-        if ((ret = getFileSub(&archive_info2[i], file_name, buffer))) {
-            if (location) *location = ARCHIVE_TYPE_NSA;
-
-            return ret;
-        }
-    }
+    index -= num_of_sar_archives;
+    if (index == 0 && num_of_nsa_archives > 0) return &archive_info;
+    if (index > 0 && index < num_of_nsa_archives)
+        return &archive_info2[index - 1];
 
-    return 0;
+    return NULL;
 }
 
 
@@ -38,18 +38,16 @@ public:
     pstring getArchiveName() const { return "nsa"; }
     int getNumFiles();
 
-    size_t getFileLength(const pstring& file_name);
-    size_t getFile(const pstring& file_name, unsigned char* buf,
-		   int* location = NULL);
     FileInfo getFileByIndex(unsigned int index);
 
+protected:
+    ArchiveInfo* getArchiveInfo(int index);
+
 private:
     bool sar_flag;
     struct ArchiveInfo archive_info2[MAX_EXTRA_ARCHIVE];
     int num_of_nsa_archives;
     pstring nsa_archive_ext;
-
-    size_t getFileLengthSub(ArchiveInfo* ai, const pstring& file_name);
 };
 
 #endif // __NSA_READER_H__
@@ -75,7 +75,11 @@ static void optionHelp()
     LOG_F(INFO, "      --disable-cpu-gfx\tdo not use Altivec graphics "
            "acceleration routines\n");
 #endif
-    LOG_F(INFO, "      --record-render-time\tRecord render times to the given csv file");
+    LOG_F(INFO, "      --record-render-time\tRecord render times to the given csv file, and archive I/O to <file>-io.csv");
+    LOG_F(INFO, "      --archive-index-cache\tkeep archive indexes in the save "
+           "directory to speed up startup\n");
+    LOG_F(INFO, "      --script-cache\tkeep the parsed script in the save "
+           "directory (or beside the script) to speed up startup\n");
     LOG_F(INFO, "      --enable-wheeldown-advance\tadvance the text on mouse "
            "wheeldown event\n");
 //    LOG_F(INFO, "      --nsa-offset offset\tuse byte offset x when reading "
@@ -198,6 +202,12 @@ static void parseOptions(int argc, char **argv, PonscripterLabel &ons,
                 argv++;
                 ons.recordRenderTimes(argv[0]);
             }
+            else if (!strcmp(argv[0] + 1, "-archive-index-cache")) {
+                ons.enableArchiveIndexCache();
+            }
+            else if (!strcmp(argv[0] + 1, "-script-cache")) {
+                ons.enableScriptCache();
+            }
             else if (!strcmp(argv[0] + 1, "-disable-rescale")) {
                 ons.disableRescale();
             }
@@ -99,12 +99,10 @@ static class sfunc_lut_t {
     typedef dictionary<pstring, PonscrFun>::t dic_t;
     dic_t dict;
 public:
+    typedef dic_t::const_iterator const_iterator;
     sfunc_lut_t();
-    PonscrFun get(pstring what) const {
-        dic_t::const_iterator it = dict.find(what);
-        if (it == dict.end()) return 0;
-        return it->second;
-    }
+    const_iterator begin() const { return dict.begin(); }
+    const_iterator end() const { return dict.end(); }
 } func_lut;
 sfunc_lut_t::sfunc_lut_t() {
     dict["abssetcursor"]     = &PonscripterLabel::setcursorCommand;
@@ -627,6 +625,9 @@ void PonscripterLabel::openAudio(int freq, Uint16 format, int channels)
 PonscripterLabel::PonscripterLabel()
     : registry_file(REGISTRY_FILE),
       dll_file(DLL_FILE),
+      image_cache(IMAGE_CACHE_SIZE),
+      image_prefetcher(decodePrefetchedImage, IMAGE_PREFETCH_THREADS),
+      prefetch_start(NULL), prefetch_scan(NULL),
       sin_table(NULL), cos_table(NULL), whirl_table(NULL),
       breakup_cells(NULL), breakup_cellforms(NULL), breakup_mask(NULL),
       music_cmd(getenv("PLAYER_CMD")),
@@ -635,6 +636,8 @@ PonscripterLabel::PonscripterLabel()
     AnimationInfo::gfx = AcceleratedGraphicsFunctions::accelerated();
 
     renderTimesFile      = NULL;
+    ioStatsFile          = NULL;
+    io_stats_misses      = 0;
     disable_rescale_flag = false;
     edit_flag            = false;
     fullscreen_mode      = false;
@@ -648,11 +651,18 @@ PonscripterLabel::PonscripterLabel()
     skip_to_wait         = 0;
     sprite_info          = new AnimationInfo[MAX_SPRITE_NUM];
     sprite2_info         = new AnimationInfo[MAX_SPRITE2_NUM];
+    showing_sprites_stamp = AnimationInfo::showing_changes - 1;
+    sprite_tile_cols = sprite_tile_rows = 0;
+    sprite_tiles_valid = false;
     enable_wheeldown_advance_flag = false;
 
     for (int i = 0; i < MAX_SPRITE2_NUM; ++i)
         sprite2_info[i].affine_flag = true;
     global_speed_modifier = 100;
+
+    for (sfunc_lut_t::const_iterator i = func_lut.begin();
+         i != func_lut.end(); ++i)
+        registerCommand(i->first, static_cast<CommandFun>(i->second));
 }
 
 
@@ -763,8 +773,89 @@ void PonscripterLabel::recordRenderTimes(const char* file) {
     renderTimesFile = fopen(file, "w");
     if (!renderTimesFile) {
         LOG_F(INFO, "Failed to open %s to record render times to, disabling", file);
+        return;
     }
     fputs("Frame,Type,Time\n", renderTimesFile);
+
+    // foo.csv gets its archive I/O in foo-io.csv.
+    pstring io_file = file;
+    if (io_file.length() > 4 &&
+        io_file.midstr(io_file.length() - 4, 4) == ".csv")
+        io_file.trunc(io_file.length() - 4);
+    io_file += "-io.csv";
+    ioStatsFile = fopen(io_file, "w");
+    if (!ioStatsFile) {
+        LOG_F(INFO, "Failed to open %s to record archive I/O to, disabling",
+              (const char*) io_file);
+        return;
+    }
+    fputs("Frame,Source,Lookups,Reads,BytesRead", ioStatsFile);
+    const int types[] = { BaseReader::NO_COMPRESSION, BaseReader::SPB_COMPRESSION,
+                          BaseReader::LZSS_COMPRESSION, BaseReader::NBZ_COMPRESSION };
+    for (int type : types) {
+        const char* name = BaseReader::compressionName(type);
+        fprintf(ioStatsFile, ",%sReads,%sBytes,%sTime", name, name, name);
+    }
+    fputc('\n', ioStatsFile);
+}
+
+
+// nsa and arc replace the reader.  Prefetch jobs may hold views into
+// its mapped archives, so they must finish or go before it does, and
+// the new reader's counts start afresh.
+void PonscripterLabel::archiveReaderClosing()
+{
+    image_prefetcher.clear();
+    image_cache.clear();
+    prefetch_start = prefetch_scan = NULL;
+    prefetch_ahead.clear();
+
+    io_stats_last.clear();
+    io_stats_misses = 0;
+}
+
+
+void PonscripterLabel::recordIOStats()
+{
+    BaseReader* reader = ScriptHandler::cBR;
+    if (!ioStatsFile || !reader) return;
+
+    Uint64 misses = reader->getLookupMisses();
+    if (misses != io_stats_misses) {
+        fprintf(ioStatsFile, "%llu,\"(not found)\",%llu,0,0",
+                (unsigned long long)frameNo,
+                (unsigned long long)(misses - io_stats_misses));
+        for (int i = 0; i < 4; i++) fputs(",0,0,0", ioStatsFile);
+        fputc('\n', ioStatsFile);
+        io_stats_misses = misses;
+    }
+
+    const int types[] = { BaseReader::NO_COMPRESSION, BaseReader::SPB_COMPRESSION,
+                          BaseReader::LZSS_COMPRESSION, BaseReader::NBZ_COMPRESSION };
+    pstring name;
+    BaseReader::IOStats stats;
+    for (size_t i = 0; reader->getIOStats(i, name, stats); i++) {
+        if (i == io_stats_last.size())
+            io_stats_last.push_back(BaseReader::IOStats());
+        BaseReader::IOStats& last = io_stats_last[i];
+        if (stats.lookups == last.lookups && stats.reads == last.reads)
+            continue;
+
+        fprintf(ioStatsFile, "%llu,\"%s\",%llu,%llu,%llu",
+                (unsigned long long)frameNo, (const char*) name,
+                (unsigned long long)(stats.lookups - last.lookups),
+                (unsigned long long)(stats.reads - last.reads),
+                (unsigned long long)(stats.bytes_read - last.bytes_read));
+        for (int type : types) {
+            fprintf(ioStatsFile, ",%llu,%llu,%f",
+                    (unsigned long long)(stats.decodes[type] - last.decodes[type]),
+                    (unsigned long long)(stats.bytes_decoded[type] - last.bytes_decoded[type]),
+                    (stats.decode_ticks[type] - last.decode_ticks[type])
+                    * perfMultiplier);
+        }
+        fputc('\n', ioStatsFile);
+        last = stats;
+    }
 }
 
 
@@ -1501,9 +1592,11 @@ void PonscripterLabel::flush(int refresh_mode, SDL_Rect* rect, bool clear_dirty_
                 flushDirect(dirty_rect.bounding_box, refresh_mode);
             }
             else {
+                buildSpriteTiles();
                 for (int i = 0; i < dirty_rect.num_history; i++) {
                     flushDirect(dirty_rect.history[i], refresh_mode, false);
                 }
+                sprite_tiles_valid = false;
 
                 flushDirect(dirty_rect.bounding_box, REFRESH_NONE_MODE);
             }
@@ -1737,7 +1830,10 @@ void PonscripterLabel::executeLabel()
             readToken();
         }
 
-        if (ret & RET_WAIT) return;
+        if (ret & RET_WAIT) {
+            prefetchImages();
+            return;
+        }
     }
 
     current_label_info = script_h.lookupLabelNext(current_label_info.name);
@@ -1815,14 +1911,12 @@ bool PonscripterLabel::isEndKinsoku(wchar char_val) {
 int PonscripterLabel::parseLine()
 {
     int ret = 0;
-    pstring cmd = script_h.getStrBuf();
-    bool is_orig_cmd = false;
-    if (cmd[0] == '_') {
-        cmd.remove(0, 1);
-        is_orig_cmd = true;
-    }
 
     if (!script_h.isText()) {
+        // Only reached for v/dv and unknown commands, so copying the
+        // token here costs nothing on the paths that run every line.
+        pstring cmd = script_h.getStrBuf();
+        if (cmd[0] == '_') cmd.remove(0, 1);
 
         if (cmd[0] == 0x0a)
             return RET_CONTINUE;
@@ -1832,16 +1926,6 @@ int PonscripterLabel::parseLine()
                  cmd[2] <= '9')
             return dvCommand(cmd);
 
-        PonscrFun f = func_lut.get(cmd);
-        if (f) {
-            if (is_orig_cmd && (debug_level > 0)) {
-                LOG_F(INFO, "** executing builtin command '%s' **",
-                       (const char*) cmd);
-                fflush(stdout);
-            }
-            return (this->*f)(cmd);
-        }
-
         errorAndCont("unknown command [" + cmd + "]");
 
         script_h.skipToken();
@@ -2352,6 +2436,7 @@ int PonscripterLabel::refreshMode()
 void PonscripterLabel::quit()
 {
     saveAll();
+    script_h.waitKidokuData();
 
     if (midi_info) {
         Mix_HaltMusic();
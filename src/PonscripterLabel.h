@@ -29,6 +29,8 @@
 #include "DirPaths.h"
 #include "ScriptParser.h"
 #include "DirtyRect.h"
+#include "ImageCache.h"
+#include "ImagePrefetcher.h"
 #include <SDL.h>
 #include <SDL_image.h>
 #include <SDL_mixer.h>
@@ -64,6 +66,11 @@
 
 #define NUM_GLYPH_CACHE 30
 
+#define IMAGE_CACHE_SIZE (64 * 1024 * 1024) // bytes of decoded images kept
+#define IMAGE_PREFETCH_THREADS 4 // at most; fewer on small machines
+#define IMAGE_PREFETCH_AHEAD 8 // upcoming image commands decoded in advance
+#define IMAGE_PREFETCH_SCAN (16 * 1024) // script bytes examined per wait
+
 struct Subtitle {
     int number;
     float time;
@@ -422,6 +429,14 @@ private:
     Uint64 frameNo;
     double perfMultiplier;
 
+    // Archive I/O per frame, written next to the render times.  Rows
+    // give the change since the counters were last written.
+    FILE*  ioStatsFile;
+    std::vector<BaseReader::IOStats> io_stats_last;
+    Uint64 io_stats_misses;
+    void recordIOStats();
+    void archiveReaderClosing();
+
     // ----------------------------------------
     // start-up options
     pstring registry_file;
@@ -621,6 +636,11 @@ private:
 	   PNG_MASK_USE_NSCRIPTER = 2
     };
     int png_mask_type;
+    ImageCache image_cache;
+    ImagePrefetcher image_prefetcher;
+    const char* prefetch_start; // script span already scanned for images
+    const char* prefetch_scan;
+    std::deque<const char*> prefetch_ahead; // image commands found in it
 
     /* ---------------------------------------- */
     /* Background related variables */
@@ -639,6 +659,30 @@ private:
     bool all_sprite_hide_flag;
     bool all_sprite2_hide_flag;
 
+    // Numbers of the sprites and sprite2s that are showing, highest
+    // (furthest back) first, so drawing and animation needn't look at
+    // every slot.  Kept current by indexShowingSprites().
+    std::vector<int> showing_sprites, showing_sprites2;
+    unsigned int showing_sprites_stamp;
+    void indexShowingSprites();
+
+    // Which drawable sprites overlap each SPRITE_TILE-square tile of
+    // the screen, for refreshSurface to pick out the few that touch a
+    // small clip.  Built by flush() for a batch of dirty rectangles and
+    // dropped afterwards, since sprites can move freely between frames.
+    enum { SPRITE_TILE = 64 };
+    typedef std::vector<std::vector<int> > sprite_tiles_t;
+    sprite_tiles_t sprite_tiles, sprite2_tiles;
+    int sprite_tile_cols, sprite_tile_rows;
+    bool sprite_tiles_valid;
+    std::vector<int> clip_sprites, clip_sprites2;
+    SDL_Rect spriteRect(AnimationInfo* anim);
+    void tileSprites(sprite_tiles_t& tiles, AnimationInfo* info,
+                     const std::vector<int>& showing);
+    void buildSpriteTiles();
+    void findTiledSprites(const sprite_tiles_t& tiles, const SDL_Rect& clip,
+                          std::vector<int>& found);
+
     /* ---------------------------------------- */
     /* Parameter related variables */
     AnimationInfo* bar_info[MAX_PARAM_NUM];
@@ -843,6 +887,11 @@ private:
     int playMP3();
     int playOGG(int format, unsigned char* buffer, long length, bool loop_flag,
                 int channel);
+    void startOggStream(OVInfo* ovi, int channels, int rate);
+    // Plays Ogg Vorbis or MP3 music straight from the archive, reading
+    // it as it is decoded; returns SOUND_NONE for anything playSound
+    // has to load whole.
+    int playMusicStream(const pstring& filename, int format);
     int playExternalMusic(bool loop_flag);
     int playMIDI(bool loop_flag);
     // Mion: for music status and fades
@@ -863,8 +912,8 @@ private:
     void playClickVoice();
     void setupWaveHeader(unsigned char* buffer, int channels, int rate,
                          int bits, unsigned long data_length);
-    OVInfo* openOggVorbis(unsigned char* buf, long len, int &channels,
-                          int &rate);
+    // Takes ownership of src, closing it on failure.
+    OVInfo* openOggVorbis(SDL_RWops* src, int &channels, int &rate);
     int  closeOggVorbis(OVInfo* ovi);
 
     /* ---------------------------------------- */
@@ -918,6 +967,16 @@ private:
     SDL_Surface* loadImage(const pstring& file_name, bool* has_alpha = NULL, bool twox = false, bool isflipped = false);
     SDL_Surface *createRectangleSurface(const char* filename);
     SDL_Surface *createSurfaceFromFile(const pstring& filename, int *location);
+    pstring imageCacheKey(const pstring& filename, bool has_alpha, bool twox, bool isflipped);
+    static SDL_Surface *decodeImage(const unsigned char* data, size_t length, const pstring& filename);
+    static SDL_Surface *convertImage(SDL_Surface* tmp, SDL_PixelFormat* format, bool* has_alpha, bool* has_colorkey);
+    static SDL_Surface *finishImage(SDL_Surface* ret, bool* has_alpha, bool has_colorkey, bool twox, bool isflipped, int res_multiplier, int png_mask_type);
+
+    void prefetchImages();
+    void prefetchImage(const pstring& image_name);
+    void queuePrefetch(const pstring& filename, bool has_alpha, bool twox, bool isflipped);
+    SDL_Surface *takePrefetchedImage(const pstring& cache_key, bool* has_alpha);
+    static void decodePrefetchedImage(ImagePrefetcher::Job& job);
 
     void shiftCursorOnButton(int diff);
     void alphaMaskBlend(SDL_Surface *mask_surface, int trans_mode,
@@ -32,6 +32,9 @@ int PonscripterLabel::proceedAnimation()
     int i, minimum_duration = -1;
     AnimationInfo* anim;
 
+    // By index, since flushDirect below may rebuild the lists.
+    indexShowingSprites();
+
     for (i = 0; i < 3; i++) {
         anim = &tachi_info[i];
         if (anim->showing() && anim->is_animatable) {
@@ -40,16 +43,16 @@ int PonscripterLabel::proceedAnimation()
         }
     }
 
-    for (i = MAX_SPRITE_NUM - 1; i >= 0; i--) {
-        anim = &sprite_info[i];
+    for (size_t k = 0; k < showing_sprites.size(); k++) {
+        anim = &sprite_info[showing_sprites[k]];
         if (anim->showing() && anim->is_animatable) {
             minimum_duration = estimateNextDuration(anim, anim->pos,
                                                     minimum_duration);
         }
     }
 
-    for (i = MAX_SPRITE2_NUM - 1; i >= 0; i--) {
-        anim = &sprite2_info[i];
+    for (size_t k = 0; k < showing_sprites2.size(); k++) {
+        anim = &sprite2_info[showing_sprites2[k]];
         if (anim->showing() && anim->is_animatable) {
             minimum_duration = estimateNextDuration(anim, anim->pos,
                                                     minimum_duration);
@@ -107,6 +110,8 @@ void PonscripterLabel::resetRemainingTime(int t)
     int i;
     AnimationInfo* anim;
 
+    indexShowingSprites();
+
     for (i = 0; i < 3; i++) {
         anim = &tachi_info[i];
         if (anim->showing() && anim->is_animatable) {
@@ -114,15 +119,15 @@ void PonscripterLabel::resetRemainingTime(int t)
         }
     }
 
-    for (i = MAX_SPRITE_NUM - 1; i >= 0; i--) {
-        anim = &sprite_info[i];
+    for (size_t k = 0; k < showing_sprites.size(); k++) {
+        anim = &sprite_info[showing_sprites[k]];
         if (anim->showing() && anim->is_animatable) {
             anim->remaining_time -= t;
         }
     }
 
-    for (i = MAX_SPRITE2_NUM - 1; i >= 0; i--) {
-        anim = &sprite2_info[i];
+    for (size_t k = 0; k < showing_sprites2.size(); k++) {
+        anim = &sprite2_info[showing_sprites2[k]];
         if (anim->showing() && anim->is_animatable) {
             anim->remaining_time -= t;
         }
@@ -3758,10 +3758,9 @@ int PonscripterLabel::autoclickCommand(const pstring& cmd)
 int PonscripterLabel::allspresumeCommand(const pstring& cmd)
 {
     all_sprite_hide_flag = false;
-    for (int i = 0; i < MAX_SPRITE_NUM; i++) {
-        if (sprite_info[i].showing())
-            dirty_rect.add(sprite_info[i].pos);
-    }
+    indexShowingSprites();
+    for (size_t i = 0; i < showing_sprites.size(); i++)
+        dirty_rect.add(sprite_info[showing_sprites[i]].pos);
 
     return RET_CONTINUE;
 }
@@ -3770,10 +3769,9 @@ int PonscripterLabel::allspresumeCommand(const pstring& cmd)
 int PonscripterLabel::allsphideCommand(const pstring& cmd)
 {
     all_sprite_hide_flag = true;
-    for (int i = 0; i < MAX_SPRITE_NUM; i++) {
-        if (sprite_info[i].showing())
-            dirty_rect.add(sprite_info[i].pos);
-    }
+    indexShowingSprites();
+    for (size_t i = 0; i < showing_sprites.size(); i++)
+        dirty_rect.add(sprite_info[showing_sprites[i]].pos);
 
     return RET_CONTINUE;
 }
@@ -3781,10 +3779,9 @@ int PonscripterLabel::allsphideCommand(const pstring& cmd)
 int PonscripterLabel::allsp2resumeCommand(const pstring& cmd)
 {
     all_sprite2_hide_flag = false;
-    for (int i = 0; i < MAX_SPRITE2_NUM; i++) {
-        if (sprite2_info[i].showing())
-            dirty_rect.add(sprite2_info[i].bounding_rect);
-    }
+    indexShowingSprites();
+    for (size_t i = 0; i < showing_sprites2.size(); i++)
+        dirty_rect.add(sprite2_info[showing_sprites2[i]].bounding_rect);
 
     return RET_CONTINUE;
 }
@@ -3793,10 +3790,9 @@ int PonscripterLabel::allsp2resumeCommand(const pstring& cmd)
 int PonscripterLabel::allsp2hideCommand(const pstring& cmd)
 {
     all_sprite2_hide_flag = true;
-    for (int i = 0; i < MAX_SPRITE2_NUM; i++) {
-        if (sprite2_info[i].showing())
-            dirty_rect.add(sprite2_info[i].bounding_rect);
-    }
+    indexShowingSprites();
+    for (size_t i = 0; i < showing_sprites2.size(); i++)
+        dirty_rect.add(sprite2_info[showing_sprites2[i]].bounding_rect);
 
     return RET_CONTINUE;
 }
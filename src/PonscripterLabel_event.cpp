@@ -1443,8 +1443,12 @@ int PonscripterLabel::eventLoop()
                 rerender();
 
                 if (renderTimesFile) {
+                    recordIOStats();
                     frameNo++;
-                    if (frameNo % 64 == 0) { fflush(renderTimesFile); }
+                    if (frameNo % 64 == 0) {
+                        fflush(renderTimesFile);
+                        if (ioStatsFile) fflush(ioStatsFile);
+                    }
                 }
 
                 /* Refresh time since rerender does take some odd ms */
@@ -25,44 +25,64 @@
 
 #include "PonscripterLabel.h"
 #include <cstdio>
+#include <algorithm>
+#include <functional>
 
 #include "graphics_common.h"
 
+pstring PonscripterLabel::imageCacheKey(const pstring& filename,
+                                        bool has_alpha, bool twox,
+                                        bool isflipped)
+{
+    // Everything loadImage does depends only on these options.
+    pstring key;
+    key.format("%d%d%d%d%d:", has_alpha, twox, isflipped,
+               res_multiplier, png_mask_type);
+    key += filename;
+    return key;
+}
+
 SDL_Surface *PonscripterLabel::loadImage(const pstring& filename,
                                         bool *has_alpha, bool twox, bool isflipped)
 {
     if (!filename) return NULL;
 
+    // A repeated load can come straight from the image cache, and an
+    // upcoming one may already have been decoded in the background.
+    pstring cache_key = imageCacheKey(filename, has_alpha != NULL,
+                                      twox, isflipped);
+    SDL_Surface *ret = image_cache.get(cache_key, has_alpha);
+    if (!ret) ret = takePrefetchedImage(cache_key, has_alpha);
+    if (ret) {
+        // Prefetched images reach the cache without passing through
+        // createSurfaceFromFile, so log them here.
+        if (filelog_flag && filename[0] != '>' && filename.find('&') < 0)
+            script_h.file_log.add(filename);
+        return ret;
+    }
+
     if (lastRenderEvent < RENDER_EVENT_LOAD_IMAGE) { lastRenderEvent = RENDER_EVENT_LOAD_IMAGE; }
 
     SDL_Surface *tmp = NULL, *tmpb = NULL;
     int location = BaseReader::ARCHIVE_TYPE_NONE;
 
+    // Loose files (including those in the save directory) may change
+    // while we run, so only cache images read from archives.
+    bool cacheable = true;
+
     CBStringList filenames = filename.split("&", 4);
 
     if (filenames[0][0] == '>')
         tmp = createRectangleSurface(filenames[0]);
-    else
+    else {
         tmp = createSurfaceFromFile(filenames[0], &location);
+        if (location == BaseReader::ARCHIVE_TYPE_NONE) cacheable = false;
+    }
 
     if (tmp == NULL) return NULL;
 
-    bool has_colorkey = false;
-
-    if ( has_alpha ){
-        *has_alpha = (tmp->format->Amask != 0);
-        if (!(*has_alpha) && (tmp->flags & SDL_TRUE)){
-            has_colorkey = true;
-            if (tmp->format->palette){
-                //palette will be converted to RGBA, so don't do colorkey check
-                has_colorkey = false;
-            }
-            *has_alpha = true;
-        }
-    }
-
-    SDL_Surface *ret = SDL_ConvertSurface( tmp, image_surface->format, SDL_SWSURFACE );
-    SDL_FreeSurface( tmp );
+    bool has_colorkey;
+    ret = convertImage(tmp, image_surface->format, has_alpha, &has_colorkey);
 
     SDL_Rect subimage_rect;
     CBStringList fileparts;
@@ -73,7 +93,9 @@ SDL_Surface *PonscripterLabel::loadImage(const pstring& filename,
         for (int x = 1; x < num_images; x++) {
             sub_filename = filenames[x];
             fileparts = sub_filename.split(",", 3);
+            location = BaseReader::ARCHIVE_TYPE_NONE;
             tmp = createSurfaceFromFile(fileparts[2], &location);
+            if (location == BaseReader::ARCHIVE_TYPE_NONE) cacheable = false;
             tmpb = SDL_ConvertSurface( tmp, image_surface->format, SDL_SWSURFACE );
             subimage_rect.x = fileparts[0];
             subimage_rect.y = fileparts[1];
@@ -85,6 +107,46 @@ SDL_Surface *PonscripterLabel::loadImage(const pstring& filename,
         }
     }
 
+    ret = finishImage(ret, has_alpha, has_colorkey, twox, isflipped,
+                      res_multiplier, png_mask_type);
+
+    if (cacheable)
+        image_cache.add(cache_key, ret, has_alpha ? *has_alpha : false);
+
+    return ret;
+}
+
+// The steps of loadImage that touch no PonscripterLabel state, shared
+// with the prefetch workers.
+SDL_Surface *PonscripterLabel::convertImage(SDL_Surface* tmp,
+                                            SDL_PixelFormat* format,
+                                            bool* has_alpha,
+                                            bool* has_colorkey)
+{
+    *has_colorkey = false;
+
+    if ( has_alpha ){
+        *has_alpha = (tmp->format->Amask != 0);
+        if (!(*has_alpha) && (tmp->flags & SDL_TRUE)){
+            *has_colorkey = true;
+            if (tmp->format->palette){
+                //palette will be converted to RGBA, so don't do colorkey check
+                *has_colorkey = false;
+            }
+            *has_alpha = true;
+        }
+    }
+
+    SDL_Surface *ret = SDL_ConvertSurface( tmp, format, SDL_SWSURFACE );
+    SDL_FreeSurface( tmp );
+    return ret;
+}
+
+SDL_Surface *PonscripterLabel::finishImage(SDL_Surface* ret, bool* has_alpha,
+                                           bool has_colorkey, bool twox,
+                                           bool isflipped, int res_multiplier,
+                                           int png_mask_type)
+{
     // Hack to detect when a PNG image is likely to have an old-style
     // mask.  We assume that an old-style mask is intended if the
     // image either has no alpha channel, or the alpha channel it has
@@ -159,11 +221,10 @@ SDL_Surface *PonscripterLabel::loadImage(const pstring& filename,
         SDL_BlitScaled(ret, NULL, retb, NULL);
 
         SDL_FreeSurface( ret );
-        return retb;
-    } else {
-        return ret;
+        ret = retb;
     }
-    
+
+    return ret;
 }
 
 SDL_Surface *PonscripterLabel::createRectangleSurface(const char* filename)
@@ -224,7 +285,9 @@ SDL_Surface *PonscripterLabel::createSurfaceFromFile(const pstring& filename,
                                                     int *location)
 {
     pstring alt_filename= "";
-    unsigned long length = script_h.cBR->getFileLength( filename );
+    BaseReader::FileRef ref;
+    unsigned long length = 0;
+    if (script_h.cBR->lookupFile(filename, ref)) length = ref.length;
 
     if (length == 0) {
         alt_filename = script_h.save_path + filename;
@@ -252,8 +315,11 @@ SDL_Surface *PonscripterLabel::createSurfaceFromFile(const pstring& filename,
     if (filelog_flag) script_h.file_log.add(filename);
 
     pstring dat = "";
+    const unsigned char* view = NULL;
     if (!alt_filename) {
-        dat = script_h.cBR->getFile(filename, location);
+        view = script_h.cBR->getFileView(ref);
+        if (!view) dat = script_h.cBR->readFile(ref);
+        if (location) *location = ref.location;
     }
     else {
         dat = script_h.cBR->getFile(alt_filename, location);
@@ -262,11 +328,20 @@ SDL_Surface *PonscripterLabel::createSurfaceFromFile(const pstring& filename,
                     (const char*)alt_filename);
     }
 
-    SDL_Surface* tmp = IMG_Load_RW(rwops(dat), 1);
+    const unsigned char* data = view ? view
+                              : (const unsigned char*) (const char*) dat;
+    return decodeImage(data, length, filename);
+}
+
+SDL_Surface *PonscripterLabel::decodeImage(const unsigned char* data,
+                                           size_t length,
+                                           const pstring& filename)
+{
+    SDL_Surface* tmp = IMG_Load_RW(SDL_RWFromConstMem(data, length), 1);
     if (!tmp && file_extension(filename).caselessEqual("jpg")) {
         LOG_F(INFO, " *** force-loading a JPEG image [%s]",
                 (const char*) filename);
-        SDL_RWops* src = rwops(dat);
+        SDL_RWops* src = SDL_RWFromConstMem(data, length);
         tmp = IMG_LoadJPG_RW(src);
         SDL_RWclose(src);
     }
@@ -279,6 +354,197 @@ SDL_Surface *PonscripterLabel::createSurfaceFromFile(const pstring& filename,
 }
 
 
+// Picks the literal image name out of an lsp, lsph, bg or ld
+// statement, or returns an empty string if there isn't one.
+static pstring prefetchName(const char* buf, const char* end)
+{
+    while (buf < end && (*buf == ' ' || *buf == '\t')) buf++;
+    const char* cmd = buf;
+    while (buf < end && *buf >= 'a' && *buf <= 'z') buf++;
+    pstring name(cmd, buf - cmd);
+
+    int skip;
+    if (name == "lsp" || name == "lsph" || name == "ld") skip = 1;
+    else if (name == "bg") skip = 0;
+    else return "";
+
+    if (buf == end || (*buf != ' ' && *buf != '\t')) return "";
+    while (skip--) {
+        while (buf < end && *buf != ',' && *buf != '"') buf++;
+        if (buf == end || *buf != ',') return "";
+        buf++;
+    }
+
+    while (buf < end && (*buf == ' ' || *buf == '\t')) buf++;
+    if (buf == end || *buf != '"') return "";
+    const char* start = ++buf;
+    while (buf < end && *buf != '"') buf++;
+    if (buf == end) return "";
+    return pstring(start, buf - start);
+}
+
+// Called whenever the interpreter stops to wait: scans the script
+// ahead of the current position for image commands with literal file
+// names and queues those images for decoding in the background.
+void PonscripterLabel::prefetchImages()
+{
+    ImagePrefetcher::Job* job;
+    while ((job = image_prefetcher.collect())) {
+        if (job->surface)
+            image_cache.add(job->key, job->surface, job->has_alpha);
+        delete job;
+    }
+
+    const char* pos = script_h.getNext();
+    const char* end = script_h.getAddress(script_h.getScriptBufferLength());
+    if (!pos || pos >= end) return;
+
+    // Carry on from where the last scan stopped, unless the script has
+    // jumped somewhere else; then the images not yet started are likely
+    // for lines that won't run.
+    if (pos < prefetch_start || pos > prefetch_scan) {
+        image_prefetcher.cancel();
+        prefetch_ahead.clear();
+        prefetch_scan = pos;
+    }
+    prefetch_start = pos;
+    while (!prefetch_ahead.empty() && prefetch_ahead.front() < pos)
+        prefetch_ahead.pop_front();
+
+    const char* limit = end - prefetch_scan > IMAGE_PREFETCH_SCAN
+                      ? prefetch_scan + IMAGE_PREFETCH_SCAN : end;
+    while (prefetch_ahead.size() < IMAGE_PREFETCH_AHEAD
+           && prefetch_scan < limit) {
+        const char* buf = prefetch_scan;
+        const char* eol = buf;
+        while (eol < end && *eol != 0x0a) eol++;
+        prefetch_scan = eol < end ? eol + 1 : end;
+
+        // Split the line into statements; quotes protect ':' and ';'.
+        const char* statement = buf;
+        bool quoted = false;
+        for (; buf <= eol; buf++) {
+            if (buf < eol && *buf == '"') quoted = !quoted;
+            if (buf < eol && (quoted || (*buf != ':' && *buf != ';')))
+                continue;
+
+            pstring image_name = prefetchName(statement, buf);
+            if (image_name) {
+                prefetch_ahead.push_back(statement);
+                prefetchImage(image_name);
+            }
+            if (buf < eol && *buf == ';') break;
+            statement = buf + 1;
+        }
+    }
+}
+
+void PonscripterLabel::prefetchImage(const pstring& image_name)
+{
+    // Picks out of the tag just what loadImage will be given, skipping
+    // the rest as parseTaggedString does.  Text sprites are drawn
+    // rather than loaded, so leave them alone.
+    bool twox = false, isflipped = false;
+    pstring mask_file_name;
+    const char* buf = image_name;
+    if (buf[0] == ':') {
+        while (*++buf == ' ') ;
+        if (buf[0] == 'b') {
+            twox = true;
+            buf++;
+        }
+        if (buf[0] == 'f') {
+            isflipped = true;
+            buf++;
+        }
+        if (buf[0] == 's' || buf[0] == 'S') return;
+
+        if (buf[0] == 'm') {
+            const char* start = ++buf;
+            while (buf[0] != ';' && buf[0] != 0x0a && buf[0]) buf++;
+            if (buf[0] == ';') mask_file_name = pstring(start, buf - start);
+        }
+        while (buf[0] != '/' && buf[0] != ';' && buf[0]) buf++;
+    }
+    if (buf[0] == '/')
+        while (buf[0] != ';' && buf[0]) buf++;
+    if (buf[0] == ';') buf++;
+
+    queuePrefetch(buf, true, twox, isflipped);
+    if (mask_file_name)
+        queuePrefetch(mask_file_name, false, twox, isflipped);
+}
+
+void PonscripterLabel::queuePrefetch(const pstring& filename, bool has_alpha,
+                                     bool twox, bool isflipped)
+{
+    // Compound images and rectangles are cheap or rare enough to be
+    // left to loadImage.
+    if (!filename || filename[0] == '>' || filename.find('&') >= 0) return;
+
+    pstring key = imageCacheKey(filename, has_alpha, twox, isflipped);
+    if (image_cache.contains(key) || image_prefetcher.pending(key)) return;
+
+    // Only archived files are cached, so only those are worth reading
+    // ahead.
+    BaseReader::FileRef ref;
+    if (!script_h.cBR->lookupFile(filename, ref)) return;
+    if (ref.location == BaseReader::ARCHIVE_TYPE_NONE) return;
+
+    ImagePrefetcher::Job* job = new ImagePrefetcher::Job;
+    job->key = key;
+    job->filename = filename;
+    job->view = script_h.cBR->getFileView(ref);
+    if (!job->view) job->file = script_h.cBR->getFileAsync(filename);
+    job->length = ref.length;
+    job->format = *image_surface->format;
+    job->want_alpha = has_alpha;
+    job->twox = twox;
+    job->isflipped = isflipped;
+    job->res_multiplier = res_multiplier;
+    job->png_mask_type = png_mask_type;
+    image_prefetcher.add(job);
+}
+
+SDL_Surface *PonscripterLabel::takePrefetchedImage(const pstring& cache_key,
+                                                   bool* has_alpha)
+{
+    ImagePrefetcher::Job* job = image_prefetcher.take(cache_key);
+    if (!job) return NULL;
+
+    SDL_Surface* ret = job->surface;
+    job->surface = NULL;
+    if (ret) {
+        if (has_alpha) *has_alpha = job->has_alpha;
+        image_cache.add(cache_key, ret, job->has_alpha);
+    }
+    delete job;
+    return ret;
+}
+
+// Runs on a prefetch worker thread.
+void PonscripterLabel::decodePrefetchedImage(ImagePrefetcher::Job& job)
+{
+    const unsigned char* data = job.view;
+    size_t length = job.length;
+    if (!data) {
+        job.file->wait();
+        data = (const unsigned char*) (const char*) job.file->data;
+        length = job.file->data.length();
+    }
+    SDL_Surface* tmp = decodeImage(data, length, job.filename);
+    if (!tmp) return;
+
+    bool has_alpha, has_colorkey;
+    bool* alpha = job.want_alpha ? &has_alpha : NULL;
+    SDL_Surface* ret = convertImage(tmp, &job.format, alpha, &has_colorkey);
+    job.surface = finishImage(ret, alpha, has_colorkey, job.twox,
+                              job.isflipped, job.res_multiplier,
+                              job.png_mask_type);
+    job.has_alpha = alpha && has_alpha;
+}
+
+
 // alphaMaskBlend
 // dst: accumulation_surface
 // src1: effect_src_surface
@@ -490,6 +756,104 @@ void PonscripterLabel::makeMonochromeSurface( SDL_Surface *surface, SDL_Rect &cl
 }
 
 
+// Rebuilds the lists of showing sprites if anything has started or
+// stopped showing since they were last built.
+void PonscripterLabel::indexShowingSprites()
+{
+    if (showing_sprites_stamp == AnimationInfo::showing_changes) return;
+    showing_sprites_stamp = AnimationInfo::showing_changes;
+
+    showing_sprites.clear();
+    for (int i = MAX_SPRITE_NUM - 1; i >= 0; --i)
+        if (sprite_info[i].showing()) showing_sprites.push_back(i);
+
+    showing_sprites2.clear();
+    for (int i = MAX_SPRITE2_NUM - 1; i >= 0; --i)
+        if (sprite2_info[i].showing()) showing_sprites2.push_back(i);
+}
+
+
+// Where drawTaggedSurface will draw a sprite.
+SDL_Rect PonscripterLabel::spriteRect(AnimationInfo* anim)
+{
+    // Affine sprites cover their bounding box, which drawTaggedSurface
+    // offsets with the text position just as it does pos.
+    SDL_Rect rect = anim->affine_flag ? anim->bounding_rect : anim->pos;
+    if (!anim->abs_flag) {
+        rect.x += int (floor(sentence_font.GetX() * screen_ratio1 / screen_ratio2));
+        rect.y += sentence_font.GetY() * screen_ratio1 / screen_ratio2;
+    }
+    return rect;
+}
+
+
+// Adds each showing sprite with an image to the tiles it overlaps,
+// keeping each tile's list in drawing order.
+void PonscripterLabel::tileSprites(sprite_tiles_t& tiles, AnimationInfo* info,
+                                   const std::vector<int>& showing)
+{
+    for (size_t t = 0; t < tiles.size(); ++t) tiles[t].clear();
+
+    for (size_t k = 0; k < showing.size(); ++k) {
+        AnimationInfo* anim = &info[showing[k]];
+        if (!anim->image_surface) continue;
+
+        SDL_Rect rect = spriteRect(anim);
+        if (rect.w <= 0 || rect.h <= 0 ||
+            rect.x + rect.w <= 0 || rect.y + rect.h <= 0) continue;
+        int x1 = std::max(rect.x, 0) / SPRITE_TILE;
+        int y1 = std::max(rect.y, 0) / SPRITE_TILE;
+        int x2 = std::min((rect.x + rect.w - 1) / SPRITE_TILE,
+                          sprite_tile_cols - 1);
+        int y2 = std::min((rect.y + rect.h - 1) / SPRITE_TILE,
+                          sprite_tile_rows - 1);
+
+        for (int y = y1; y <= y2; ++y)
+            for (int x = x1; x <= x2; ++x)
+                tiles[y * sprite_tile_cols + x].push_back(showing[k]);
+    }
+}
+
+
+void PonscripterLabel::buildSpriteTiles()
+{
+    indexShowingSprites();
+
+    sprite_tile_cols = (screen_width + SPRITE_TILE - 1) / SPRITE_TILE;
+    sprite_tile_rows = (screen_height + SPRITE_TILE - 1) / SPRITE_TILE;
+    sprite_tiles.resize(sprite_tile_cols * sprite_tile_rows);
+    sprite2_tiles.resize(sprite_tile_cols * sprite_tile_rows);
+
+    tileSprites(sprite_tiles, sprite_info, showing_sprites);
+    tileSprites(sprite2_tiles, sprite2_info, showing_sprites2);
+    sprite_tiles_valid = true;
+}
+
+
+// Collects the sprites in the tiles under clip, in drawing order.
+void PonscripterLabel::findTiledSprites(const sprite_tiles_t& tiles,
+                                        const SDL_Rect& clip,
+                                        std::vector<int>& found)
+{
+    found.clear();
+    int x1 = std::max(clip.x, 0) / SPRITE_TILE;
+    int y1 = std::max(clip.y, 0) / SPRITE_TILE;
+    int x2 = std::min((clip.x + clip.w - 1) / SPRITE_TILE, sprite_tile_cols - 1);
+    int y2 = std::min((clip.y + clip.h - 1) / SPRITE_TILE, sprite_tile_rows - 1);
+
+    for (int y = y1; y <= y2; ++y)
+        for (int x = x1; x <= x2; ++x) {
+            const std::vector<int>& tile = tiles[y * sprite_tile_cols + x];
+            found.insert(found.end(), tile.begin(), tile.end());
+        }
+
+    if (x1 != x2 || y1 != y2) {
+        std::sort(found.begin(), found.end(), std::greater<int>());
+        found.erase(std::unique(found.begin(), found.end()), found.end());
+    }
+}
+
+
 void
 PonscripterLabel::refreshSurface(SDL_Surface* surface, SDL_Rect* clip_src,
 				 int refresh_mode)
@@ -500,17 +864,29 @@ PonscripterLabel::refreshSurface(SDL_Surface* surface, SDL_Rect* clip_src,
     if (clip_src && AnimationInfo::doClipping(&clip, clip_src)) return;
 
     int i, top;
+    std::vector<int>::const_iterator it;
     SDL_BlitSurface( bg_info.image_surface, &clip, surface, &clip );
 
+    indexShowingSprites();
+    const std::vector<int>* sprites = &showing_sprites;
+    const std::vector<int>* sprites2 = &showing_sprites2;
+    if (sprite_tiles_valid) {
+        findTiledSprites(sprite_tiles, clip, clip_sprites);
+        findTiledSprites(sprite2_tiles, clip, clip_sprites2);
+        sprites = &clip_sprites;
+        sprites2 = &clip_sprites2;
+    }
+
     if (!all_sprite_hide_flag) {
         if (z_order < 10 && refresh_mode & REFRESH_SAYA_MODE)
             top = 9;
         else
             top = z_order;
     
-        for (i = MAX_SPRITE_NUM - 1; i > top; --i) {
-            if (sprite_info[i].image_surface && sprite_info[i].showing())
-                drawTaggedSurface(surface, &sprite_info[i], clip);
+        for (it = sprites->begin();
+             it != sprites->end() && *it > top; ++it) {
+            if (sprite_info[*it].image_surface)
+                drawTaggedSurface(surface, &sprite_info[*it], clip);
         }
     }
 
@@ -526,9 +902,10 @@ PonscripterLabel::refreshSurface(SDL_Surface* surface, SDL_Rect* clip_src,
         if (nega_mode == 2) makeNegaSurface(surface, clip);
 
         if (!all_sprite2_hide_flag) {
-            for (i = MAX_SPRITE2_NUM - 1; i >= 0; --i) {
-                if (sprite2_info[i].image_surface && sprite2_info[i].showing())
-                    drawTaggedSurface(surface, &sprite2_info[i], clip);
+            for (it = sprites2->begin();
+                 it != sprites2->end(); ++it) {
+                if (sprite2_info[*it].image_surface)
+                    drawTaggedSurface(surface, &sprite2_info[*it], clip);
             }
         }
 
@@ -543,18 +920,20 @@ PonscripterLabel::refreshSurface(SDL_Surface* surface, SDL_Rect* clip_src,
             top = 10;
         else
             top = 0;
-        for (i = z_order; i >= top; --i) {
-            if (sprite_info[i].image_surface && sprite_info[i].showing())
-                drawTaggedSurface(surface, &sprite_info[i], clip);
+        for (it = sprites->begin();
+             it != sprites->end() && *it >= top; ++it) {
+            if (*it <= z_order && sprite_info[*it].image_surface)
+                drawTaggedSurface(surface, &sprite_info[*it], clip);
         }
     }
 
     if (!windowback_flag) {
         //Mion - ogapee2008
         if (!all_sprite2_hide_flag) {
-            for (i = MAX_SPRITE2_NUM - 1; i >= 0; --i) {
-                if (sprite2_info[i].image_surface && sprite2_info[i].showing())
-                    drawTaggedSurface(surface, &sprite2_info[i], clip);
+            for (it = sprites2->begin();
+                 it != sprites2->end(); ++it) {
+                if (sprite2_info[*it].image_surface)
+                    drawTaggedSurface(surface, &sprite2_info[*it], clip);
             }
         }
         if (nega_mode == 1) makeNegaSurface(surface, clip);
@@ -181,7 +181,9 @@ int PonscripterLabel::playSound(const pstring& filename, int format,
     if ( !audio_open_flag ) return SOUND_NONE;
     if (filename.length() == 0) return SOUND_NONE;
 
-    long length = script_h.cBR->getFileLength( filename );
+    BaseReader::FileRef ref;
+    long length = 0;
+    if (script_h.cBR->lookupFile(filename, ref)) length = ref.length;
     if (length == 0) {
         errorAndCont(filename + " not found");
         return SOUND_NONE;
@@ -197,6 +199,11 @@ int PonscripterLabel::playSound(const pstring& filename, int format,
             return SOUND_NONE;
     }
 
+    if (format & (SOUND_MP3 | SOUND_OGG_STREAMING)) {
+        int ret = playMusicStream(filename, format);
+        if (ret != SOUND_NONE) return ret;
+    }
+
     unsigned char* buffer;
 
     if ((format & (SOUND_MP3 | SOUND_OGG_STREAMING)) &&
@@ -207,7 +214,7 @@ int PonscripterLabel::playSound(const pstring& filename, int format,
     else{
         if (lastRenderEvent < RENDER_EVENT_LOAD_AUDIO) { lastRenderEvent = RENDER_EVENT_LOAD_AUDIO; }
         buffer = new unsigned char[length];
-        script_h.cBR->getFile( filename, buffer );
+        script_h.cBR->readFile( ref, buffer );
     }
 
     if (format & (SOUND_OGG | SOUND_OGG_STREAMING)) {
@@ -242,7 +249,7 @@ int PonscripterLabel::playSound(const pstring& filename, int format,
             }
         }
 
-        mp3_sample = SMPEG_new_rwops(SDL_RWFromMem(buffer, length), NULL, 0, 0);
+        mp3_sample = SMPEG_new_rwops(SDL_RWFromMem(buffer, length), NULL, 1, 0);
         if (playMP3() == 0) {
             music_buffer = buffer;
             music_buffer_length = length;
@@ -343,7 +350,8 @@ int PonscripterLabel::playMP3()
 int PonscripterLabel::playOGG(int format, unsigned char* buffer, long length, bool loop_flag, int channel)
 {
     int channels, rate;
-    OVInfo* ovi = openOggVorbis(buffer, length, channels, rate);
+    OVInfo* ovi = openOggVorbis(SDL_RWFromConstMem(buffer, length),
+                                channels, rate);
     if (ovi == NULL) return SOUND_OTHER;
 
     if (format & SOUND_OGG) {
@@ -365,6 +373,17 @@ int PonscripterLabel::playOGG(int format, unsigned char* buffer, long length, bo
         return SOUND_OGG;
     }
 
+    startOggStream(ovi, channels, rate);
+
+    music_buffer = buffer;
+    music_buffer_length = length;
+
+    return SOUND_OGG_STREAMING;
+}
+
+
+void PonscripterLabel::startOggStream(OVInfo* ovi, int channels, int rate)
+{
     if ((audio_format.format != AUDIO_S16) ||
         (audio_format.freq != rate)) {
         Mix_CloseAudio();
@@ -386,11 +405,39 @@ int PonscripterLabel::playOGG(int format, unsigned char* buffer, long length, bo
     music_struct.volume = music_volume;
     music_struct.is_mute = !volume_on_flag;
     Mix_HookMusic(oggcallback, &music_struct);
+}
 
-    music_buffer = buffer;
-    music_buffer_length = length;
 
-    return SOUND_OGG_STREAMING;
+int PonscripterLabel::playMusicStream(const pstring& filename, int format)
+{
+    SDL_RWops* src = script_h.cBR->openStream(filename);
+    if (!src) return SOUND_NONE;
+
+    unsigned char magic[4] = { 0, 0, 0, 0 };
+    SDL_RWread(src, magic, 1, 4);
+    SDL_RWseek(src, 0, RW_SEEK_SET);
+
+    if ((format & SOUND_OGG_STREAMING) && !memcmp(magic, "OggS", 4)) {
+        int channels, rate;
+        OVInfo* ovi = openOggVorbis(src, channels, rate);
+        if (ovi == NULL) return SOUND_NONE;
+
+        startOggStream(ovi, channels, rate);
+        return SOUND_OGG_STREAMING;
+    }
+
+    // An ID3 tag or an MPEG audio frame sync.  External players are
+    // given a copy of the file, so leave those to playSound.
+    bool is_mp3 = !memcmp(magic, "ID3", 3) ||
+                  (magic[0] == 0xff && (magic[1] & 0xe0) == 0xe0);
+    if ((format & SOUND_MP3) && is_mp3 && !music_cmd) {
+        mp3_sample = SMPEG_new_rwops(src, NULL, 1, 0);
+        if (playMP3() == 0) return SOUND_MP3;
+        return SOUND_NONE;
+    }
+
+    SDL_RWclose(src);
+    return SOUND_NONE;
 }
 
 
@@ -535,8 +582,12 @@ int PonscripterLabel::playMPEG(const pstring& filename, bool click_flag, bool lo
     int ret = 0;
 #ifndef MP3_MAD
     bool different_spec = false;
-    pstring mpeg_dat = ScriptHandler::cBR->getFile(filename);
-    SMPEG* mpeg_sample = SMPEG_new_rwops(rwops(mpeg_dat), 0, 0, 0);
+    SDL_RWops* src = ScriptHandler::cBR->openStream(filename);
+    if (!src) {
+        errorAndCont(filename + " not found");
+        return 0;
+    }
+    SMPEG* mpeg_sample = SMPEG_new_rwops(src, 0, 1, 0);
     if (!SMPEG_error(mpeg_sample)) {
         SMPEG_enableaudio(mpeg_sample, 0);
 
@@ -941,14 +992,7 @@ static size_t oc_read_func(void* ptr, size_t size, size_t nmemb,
 {
     OVInfo* ogg_vorbis_info = (OVInfo*) datasource;
 
-    ogg_int64_t len = size * nmemb;
-    if (ogg_vorbis_info->pos + len > ogg_vorbis_info->length)
-        len = ogg_vorbis_info->length - ogg_vorbis_info->pos;
-
-    memcpy(ptr, ogg_vorbis_info->buf + ogg_vorbis_info->pos, len);
-    ogg_vorbis_info->pos += len;
-
-    return len;
+    return SDL_RWread(ogg_vorbis_info->src, ptr, size, nmemb);
 }
 
 
@@ -956,17 +1000,7 @@ static int oc_seek_func(void* datasource, ogg_int64_t offset, int whence)
 {
     OVInfo* ogg_vorbis_info = (OVInfo*) datasource;
 
-    ogg_int64_t pos = 0;
-    if (whence == 0)
-        pos = offset;
-    else if (whence == 1)
-        pos = ogg_vorbis_info->pos + offset;
-    else if (whence == 2)
-        pos = ogg_vorbis_info->length + offset;
-
-    if (pos < 0 || pos > ogg_vorbis_info->length) return -1;
-
-    ogg_vorbis_info->pos = pos;
+    if (SDL_RWseek(ogg_vorbis_info->src, offset, whence) < 0) return -1;
 
     return 0;
 }
@@ -982,12 +1016,12 @@ static long oc_tell_func(void* datasource)
 {
     OVInfo* ogg_vorbis_info = (OVInfo*) datasource;
 
-    return ogg_vorbis_info->pos;
+    return SDL_RWtell(ogg_vorbis_info->src);
 }
 
 
 #endif
-OVInfo* PonscripterLabel::openOggVorbis(unsigned char* buf, long len,
+OVInfo* PonscripterLabel::openOggVorbis(SDL_RWops* src,
                                         int &channels, int &rate)
 {
     OVInfo* ovi = NULL;
@@ -999,10 +1033,8 @@ OVInfo* PonscripterLabel::openOggVorbis(unsigned char* buf, long len,
     ogg_int64_t fullLength;
     ovi = new OVInfo();
 
-    ovi->buf = buf;
+    ovi->src = src;
     ovi->decoded_length = 0;
-    ovi->length = len;
-    ovi->pos = 0;
     ovi->loop         = -1;
     ovi->loop_start   = -1;
     ovi->loop_end     =  0;
@@ -1014,6 +1046,7 @@ OVInfo* PonscripterLabel::openOggVorbis(unsigned char* buf, long len,
     oc.close_func = oc_close_func;
     oc.tell_func  = oc_tell_func;
     if (ov_open_callbacks(ovi, &ovi->ovf, NULL, 0, oc) < 0) {
+        SDL_RWclose(src);
         delete ovi;
         return NULL;
     }
@@ -1021,6 +1054,7 @@ OVInfo* PonscripterLabel::openOggVorbis(unsigned char* buf, long len,
     vorbis_info* vi = ov_info(&ovi->ovf, -1);
     if (vi == NULL) {
         ov_clear(&ovi->ovf);
+        SDL_RWclose(src);
         delete ovi;
         return NULL;
     }
@@ -1092,6 +1126,8 @@ OVInfo* PonscripterLabel::openOggVorbis(unsigned char* buf, long len,
     ovi->mult2 = (int) (ovi->cvt.len_ratio * 10.0);
 
     ovi->decoded_length = ov_pcm_total(&ovi->ovf, -1) * channels * 2;
+#else
+    SDL_RWclose(src);
 #endif
 
     return ovi;
@@ -1100,13 +1136,12 @@ OVInfo* PonscripterLabel::openOggVorbis(unsigned char* buf, long len,
 
 int PonscripterLabel::closeOggVorbis(OVInfo* ovi)
 {
-    if (ovi->buf) {
-        ovi->buf = NULL;
+    if (ovi->src) {
 #ifdef USE_OGG_VORBIS
-        ovi->length = 0;
-        ovi->pos = 0;
         ov_clear(&ovi->ovf);
 #endif
+        SDL_RWclose(ovi->src);
+        ovi->src = NULL;
     }
 
     if (ovi->cvt.buf) {
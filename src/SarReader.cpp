@@ -26,8 +26,33 @@
 #include "SarReader.h"
 
 #include <loguru.hpp>
+#include <string.h>
+#include <sys/stat.h>
 #define WRITE_LENGTH 4096
 
+// An index snapshot is this header, num_of_files SnapshotEntry records,
+// then a string table holding the archive path followed by the entry
+// names.  Fields are native-endian: snapshots never leave the machine.
+#define INDEX_SNAPSHOT_MAGIC "PNSIDX01"
+
+struct SnapshotHeader {
+    char magic[8];
+    Uint64 archive_size;
+    Sint64 archive_mtime;
+    Uint32 key;          // indexSnapshotKey()
+    Uint32 num_of_files;
+    Uint32 base_offset;
+    Uint32 path_length;
+    Uint32 names_length; // string table size, path included
+    Uint32 reserved;
+};
+
+struct SnapshotEntry {
+    Uint32 name_offset, name_length;
+    Uint32 compression_type;
+    Uint32 offset, length, original_length;
+};
+
 SarReader::SarReader(DirPaths *path, const unsigned char* key_table)
     : DirectReader(path, key_table),
       num_of_sar_archives(0)
@@ -46,14 +71,16 @@ int SarReader::open(const pstring& name, int archive_type)
 {
     ArchiveInfo* info = new ArchiveInfo();
 
-    if ((info->file_handle = fileopen(name, "rb")) == NULL) {
+    if ((info->file_handle = fileopen(name, "rb", &info->open_path)) == NULL) {
         delete info;
         return -1;
     }
 
     info->file_name = name;
 
-    readArchive(info);
+    loadArchive(info);
+    mapArchive(info);
+    addToIndex(info, ARCHIVE_TYPE_SAR);
 
     last_archive_info->next = info;
     last_archive_info = last_archive_info->next;
@@ -125,6 +152,29 @@ int SarReader::readArchive(ArchiveInfo* ai, int archive_type)
             ai->fi_list[i].original_length = ai->fi_list[i].length;
         }
 
+    }
+
+    return 0;
+}
+
+
+// Reads the archive's index, from a snapshot if there is a current one.
+// Snapshots hold the index as stored in the archive, so compression
+// types registered since it was written still apply.
+void SarReader::loadArchive(ArchiveInfo* ai, int archive_type)
+{
+    if (!loadIndexSnapshot(ai, archive_type)) {
+        readArchive(ai, archive_type);
+        saveIndexSnapshot(ai, archive_type);
+    }
+
+    checkCompressionTypes(ai);
+}
+
+
+void SarReader::checkCompressionTypes(ArchiveInfo* ai)
+{
+    for (unsigned int i = 0; i < ai->num_of_files; i++) {
         /* Registered Plugin check */
         if (ai->fi_list[i].compression_type == NO_COMPRESSION)
             ai->fi_list[i].compression_type =
@@ -142,13 +192,167 @@ int SarReader::readArchive(ArchiveInfo* ai, int archive_type)
             //ai->fi_list[i].original_length = getDecompressedFileLength( ai->fi_list[i].compression_type, ai->file_handle, ai->fi_list[i].offset );
         }
     }
+}
 
-    return 0;
+
+pstring SarReader::indexSnapshotPath(const ArchiveInfo* ai) const
+{
+    pstring path;
+    path.format("arcindex_%08x.dat",
+                (unsigned int) pstring_hash()(ai->file_name));
+    return index_cache_dir + path;
+}
+
+
+// Everything besides the archive file itself that the index depends
+// on: the archive path and type, the key table, and the encoding names
+// are converted to.
+unsigned int SarReader::indexSnapshotKey(const ArchiveInfo* ai,
+                                         int archive_type) const
+{
+    pstring key = ai->file_name;
+    key += (const char*) file_encoding->which();
+    key += pstring(key_table, 256);
+    key += (char) archive_type;
+    return (unsigned int) pstring_hash()(key);
+}
+
+
+bool SarReader::loadIndexSnapshot(ArchiveInfo* ai, int archive_type)
+{
+    if (!index_cache_dir) return false;
+
+    struct stat archive_st, st;
+    if (fstat(fileno(ai->file_handle), &archive_st) != 0) return false;
+
+    FILE* fp = fopen(indexSnapshotPath(ai), "rb");
+    if (!fp) return false;
+    if (fstat(fileno(fp), &st) != 0 ||
+        (size_t) st.st_size < sizeof(SnapshotHeader)) {
+        fclose(fp);
+        return false;
+    }
+    size_t size = st.st_size;
+
+#ifdef USE_MMAP_ARCHIVES
+    void* map = mmap(NULL, size, PROT_READ, MAP_SHARED, fileno(fp), 0);
+    fclose(fp);
+    if (map == MAP_FAILED) return false;
+    const unsigned char* data = (const unsigned char*) map;
+#else
+    std::vector<unsigned char> buf(size);
+    size_t len = fread(&buf[0], 1, size, fp);
+    fclose(fp);
+    if (len != size) return false;
+    const unsigned char* data = &buf[0];
+#endif
+
+    const SnapshotHeader* header = (const SnapshotHeader*) data;
+    const SnapshotEntry* entries = (const SnapshotEntry*) (header + 1);
+    const char* names = (const char*) (entries + header->num_of_files);
+
+    bool valid =
+        !memcmp(header->magic, INDEX_SNAPSHOT_MAGIC, sizeof(header->magic)) &&
+        header->archive_size == (Uint64) archive_st.st_size &&
+        header->archive_mtime == (Sint64) archive_st.st_mtime &&
+        header->key == indexSnapshotKey(ai, archive_type) &&
+        header->num_of_files <= 0xffff &&
+        size == sizeof(SnapshotHeader)
+              + header->num_of_files * sizeof(SnapshotEntry)
+              + header->names_length &&
+        header->path_length <= header->names_length &&
+        ai->file_name == pstring(names, header->path_length);
+
+    for (unsigned int i = 0; valid && i < header->num_of_files; i++)
+        valid = entries[i].name_offset <= header->names_length &&
+            entries[i].name_length <= header->names_length
+                                      - entries[i].name_offset;
+
+    if (valid) {
+        ai->num_of_files = header->num_of_files;
+        ai->base_offset = header->base_offset;
+        ai->fi_list = new FileInfo[ai->num_of_files];
+        for (unsigned int i = 0; i < ai->num_of_files; i++) {
+            FileInfo& fi = ai->fi_list[i];
+            fi.name = pstring(names + entries[i].name_offset,
+                              entries[i].name_length);
+            fi.compression_type = entries[i].compression_type;
+            fi.offset = entries[i].offset;
+            fi.length = entries[i].length;
+            fi.original_length = entries[i].original_length;
+        }
+    }
+
+#ifdef USE_MMAP_ARCHIVES
+    munmap(map, size);
+#endif
+    return valid;
+}
+
+
+void SarReader::saveIndexSnapshot(ArchiveInfo* ai, int archive_type)
+{
+    if (!index_cache_dir) return;
+
+    struct stat archive_st;
+    if (fstat(fileno(ai->file_handle), &archive_st) != 0) return;
+
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.archive_size = archive_st.st_size;
+    header.archive_mtime = archive_st.st_mtime;
+    header.key = indexSnapshotKey(ai, archive_type);
+    header.num_of_files = ai->num_of_files;
+    header.base_offset = ai->base_offset;
+    header.path_length = ai->file_name.length();
+
+    std::vector<SnapshotEntry> entries(ai->num_of_files);
+    pstring names = ai->file_name;
+    for (unsigned int i = 0; i < ai->num_of_files; i++) {
+        const FileInfo& fi = ai->fi_list[i];
+        entries[i].name_offset = names.length();
+        entries[i].name_length = fi.name.length();
+        entries[i].compression_type = fi.compression_type;
+        entries[i].offset = fi.offset;
+        entries[i].length = fi.length;
+        entries[i].original_length = fi.original_length;
+        names += fi.name;
+    }
+    header.names_length = names.length();
+
+    // Write to a temporary name and move it into place, so a reader
+    // never sees half a snapshot.
+    pstring path = indexSnapshotPath(ai);
+    pstring tmp_path = path + ".tmp";
+    FILE* fp = fopen(tmp_path, "wb");
+    if (!fp) return;
+
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    if (ok && !entries.empty())
+        ok = fwrite(&entries[0], sizeof(SnapshotEntry), entries.size(), fp)
+             == entries.size();
+    if (ok)
+        ok = fwrite((const char*) names, 1, names.length(), fp)
+             == (size_t) names.length();
+    if (fclose(fp) != 0) ok = false;
+
+    if (ok) {
+        remove(path);
+        ok = rename(tmp_path, path) == 0;
+    }
+    if (!ok) {
+        LOG_F(INFO, "can't write archive index snapshot %s",
+              (const char*) path);
+        remove(tmp_path);
+    }
 }
 
 
 int SarReader::close()
 {
+    waitAsync();
+
     ArchiveInfo* info = archive_info.next;
 
     for (int i = 0; i < num_of_sar_archives; i++) {
@@ -157,11 +361,24 @@ int SarReader::close()
         delete last_archive_info;
     }
     num_of_sar_archives = 0;
+    archive_index.clear();
 
     return 0;
 }
 
 
+SarReader::ArchiveInfo* SarReader::getArchiveInfo(int index)
+{
+    ArchiveInfo* info = archive_info.next;
+    for (int i = 0; i < num_of_sar_archives && info; i++) {
+        if (i == index) return info;
+        info = info->next;
+    }
+
+    return NULL;
+}
+
+
 int SarReader::getNumFiles()
 {
     ArchiveInfo* info = archive_info.next;
@@ -176,94 +393,127 @@ int SarReader::getNumFiles()
 }
 
 
-int SarReader::getIndexFromFile(ArchiveInfo* ai, pstring file_name)
+void SarReader::addToIndex(ArchiveInfo* ai, int location)
 {
-    replace_ascii(file_name, '/', '\\');
-    
-    unsigned int i;
-    for (i = 0; i < ai->num_of_files; i++) {
-	if (file_name.caselessEqual(ai->fi_list[i].name)) break;
-    }
+    archive_index.reserve(archive_index.size() + ai->num_of_files);
 
-    return i;
+    for (unsigned int i = 0; i < ai->num_of_files; i++) {
+        pstring key = ai->fi_list[i].name;
+        key.tolower();
+        IndexEntry entry = { ai, i, location };
+        archive_index.insert(std::make_pair(key, entry));
+    }
 }
 
 
-size_t SarReader::getFileLength(const pstring& file_name)
+const SarReader::IndexEntry* SarReader::findInIndex(const pstring& file_name) const
 {
-    size_t ret;
-    if ((ret = DirectReader::getFileLength(file_name))) return ret;
+    pstring key = file_name;
+    replace_ascii(key, '/', '\\');
+    key.tolower();
 
-    ArchiveInfo* info = archive_info.next;
-    unsigned int j = 0;
-    for (int i = 0; i < num_of_sar_archives; i++) {
-        j = getIndexFromFile(info, file_name);
-        if (j != info->num_of_files) break;
+    archive_index_t::const_iterator it = archive_index.find(key);
+    if (it == archive_index.end()) return NULL;
 
-        info = info->next;
-    }
+    return &it->second;
+}
 
-    if (!info) return 0;
 
-    if ( info->fi_list[j].original_length != 0 ){
-        return info->fi_list[j].original_length;
+size_t SarReader::getFileLengthSub(ArchiveInfo* ai, unsigned int no, int type)
+{
+    if ( ai->fi_list[no].original_length != 0 ){
+        return ai->fi_list[no].original_length;
     }
 
-    int type = info->fi_list[j].compression_type;
-    if ( type == NO_COMPRESSION )
-        type = getRegisteredCompressionType( file_name );
     if ( type == NBZ_COMPRESSION || type == SPB_COMPRESSION ) {
-        info->fi_list[j].original_length = getDecompressedFileLength( type, info->file_handle, info->fi_list[j].offset );
+        ai->fi_list[no].original_length = getDecompressedFileLength( type, ai->file_handle, ai->fi_list[no].offset );
     }
 
-    return info->fi_list[j].original_length;
+    return ai->fi_list[no].original_length;
 }
 
 
-size_t SarReader::getFileSub(ArchiveInfo* ai, const pstring& file_name,
-			     unsigned char* buf)
+bool SarReader::lookupFile(const pstring& file_name, FileRef& ref)
 {
-    unsigned int i = getIndexFromFile(ai, file_name);
-    if (i == ai->num_of_files) return 0;
+    if (lookupLooseFile(file_name, ref)) {
+        countLookup(&loose_stats);
+        return true;
+    }
+
+    const IndexEntry* entry = findInIndex(file_name);
+    if (!entry) {
+        countLookup(NULL);
+        return false;
+    }
 
-    int type = ai->fi_list[i].compression_type;
-    if (type == NO_COMPRESSION) type = getRegisteredCompressionType(file_name);
+    ref.ai = entry->ai;
+    ref.no = entry->no;
+    ref.location = entry->location;
+    ref.compression_type = ref.ai->fi_list[ref.no].compression_type;
+    if (ref.compression_type == NO_COMPRESSION)
+        ref.compression_type = getRegisteredCompressionType(file_name);
+    ref.length = getFileLengthSub(ref.ai, ref.no, ref.compression_type);
+
+    bool found = ref.length > 0;
+    countLookup(found ? &ref.ai->stats : NULL);
+    return found;
+}
+
+
+size_t SarReader::getFileSub(ArchiveInfo* ai, unsigned int no, int type,
+                             unsigned char* buf)
+{
+    size_t offset = ai->fi_list[no].offset;
+    if (ai->map_base && offset < ai->map_length)
+        return decodeEntry(type, ai->map_base + offset,
+                           ai->map_length - offset,
+                           ai->fi_list[no].original_length, buf);
 
     if (type == NBZ_COMPRESSION) {
-        return decodeNBZ(ai->file_handle, ai->fi_list[i].offset, buf);
+        return decodeNBZ(ai->file_handle, offset, buf);
     }
     else if (type == LZSS_COMPRESSION) {
-        return decodeLZSS(ai, i, buf);
+        return decodeLZSS(ai, no, buf);
     }
     else if (type == SPB_COMPRESSION) {
-        return decodeSPB(ai->file_handle, ai->fi_list[i].offset, buf);
+        return decodeSPB(ai->file_handle, offset, buf);
     }
 
-    fseek(ai->file_handle, ai->fi_list[i].offset, SEEK_SET);
-    size_t ret = fread(buf, 1, ai->fi_list[i].length, ai->file_handle);
+    fseek(ai->file_handle, offset, SEEK_SET);
+    size_t ret = fread(buf, 1, ai->fi_list[no].length, ai->file_handle);
     for (size_t j = 0; j < ret; j++) buf[j] = key_table[buf[j]];
 
     return ret;
 }
 
 
-size_t SarReader::getFile(const pstring& file_name, unsigned char* buf,
-			  int* location)
+const unsigned char* SarReader::getFileView(FileRef& ref)
 {
-    size_t ret;
-    if ((ret = DirectReader::getFile(file_name, buf, location))) return ret;
+    if (!ref.ai || !ref.ai->map_base || key_table_flag ||
+        ref.compression_type != NO_COMPRESSION)
+        return NULL;
 
-    ArchiveInfo* info = archive_info.next;
-    size_t j = 0;
-    for (int i = 0; i < num_of_sar_archives; i++) {
-        if ((j = getFileSub(info, file_name, buf)) > 0) break;
+    const FileInfo& fi = ref.ai->fi_list[ref.no];
+    if (fi.offset > ref.ai->map_length ||
+        fi.length > ref.ai->map_length - fi.offset)
+        return NULL;
 
-        info = info->next;
-    }
+    countRead(ref.ai->stats, NO_COMPRESSION, fi.length, fi.length, 0);
+    return ref.ai->map_base + fi.offset;
+}
 
-    if (location) *location = ARCHIVE_TYPE_SAR;
 
-    return j;
+size_t SarReader::readFile(FileRef& ref, unsigned char* buf)
+{
+    if (!ref.ai) return DirectReader::readFile(ref, buf);
+
+    Uint64 begin = SDL_GetPerformanceCounter();
+    size_t ret = getFileSub(ref.ai, ref.no, ref.compression_type, buf);
+    countRead(ref.ai->stats, ref.compression_type,
+              ref.ai->fi_list[ref.no].length, ret,
+              SDL_GetPerformanceCounter() - begin);
+
+    return ret;
 }
 
 
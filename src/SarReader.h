@@ -38,20 +38,49 @@ public:
     pstring getArchiveName() const { return "sar"; }
     int getNumFiles();
 
-    size_t getFileLength(const pstring& file_name);
-    size_t getFile(const pstring& file_name, unsigned char* buf,
-		   int* location = NULL);
+    bool lookupFile(const pstring& file_name, FileRef& ref);
+    size_t readFile(FileRef& ref, unsigned char* buf);
+    const unsigned char* getFileView(FileRef& ref);
     FileInfo getFileByIndex(unsigned int index);
 
+    // Directory in which to keep snapshots of archive indexes, so the
+    // next open can skip parsing the archive headers.  Empty (the
+    // default) disables the snapshots.
+    void setIndexCacheDir(const pstring& dir) { index_cache_dir = dir; }
+
 protected:
     ArchiveInfo  archive_info;
     ArchiveInfo* root_archive_info, * last_archive_info;
     int num_of_sar_archives;
 
+    // Lookup table over every indexed archive, keyed on the
+    // case-folded, backslash-separated file name.  Archives are added
+    // in search order and the first entry for a name wins, so a
+    // lookup gives the same result as scanning the archives in turn.
+    struct IndexEntry {
+        ArchiveInfo* ai;
+        unsigned int no;
+        int location;
+    };
+    typedef std::unordered_map<pstring, IndexEntry, pstring_hash> archive_index_t;
+    archive_index_t archive_index;
+
+    ArchiveInfo* getArchiveInfo(int index);
+    void addToIndex(ArchiveInfo* ai, int location);
+    const IndexEntry* findInIndex(const pstring& file_name) const;
+
+    pstring index_cache_dir;
+
+    void loadArchive(ArchiveInfo* ai, int archive_type = ARCHIVE_TYPE_SAR);
     int readArchive(ArchiveInfo* ai, int archive_type = ARCHIVE_TYPE_SAR);
-    int getIndexFromFile(ArchiveInfo* ai, pstring file_name);
-    size_t getFileSub(ArchiveInfo* ai, const pstring& file_name,
-		      unsigned char* buf);
+    void checkCompressionTypes(ArchiveInfo* ai);
+    pstring indexSnapshotPath(const ArchiveInfo* ai) const;
+    unsigned int indexSnapshotKey(const ArchiveInfo* ai, int archive_type) const;
+    bool loadIndexSnapshot(ArchiveInfo* ai, int archive_type);
+    void saveIndexSnapshot(ArchiveInfo* ai, int archive_type);
+    size_t getFileLengthSub(ArchiveInfo* ai, unsigned int no, int type);
+    size_t getFileSub(ArchiveInfo* ai, unsigned int no, int type,
+                      unsigned char* buf);
 };
 
 #endif // __SAR_READER_H__
@@ -38,7 +38,6 @@
 #include <CoreFoundation/CoreFoundation.h>
 #endif
 
-#define TMP_SCRIPT_BUF_LEN 4096
 #define STRING_BUFFER_LENGTH 2048
 
 #define SKIP_SPACE(p) while (*(p) == ' ' || *(p) == '\t') (p)++
@@ -52,7 +51,9 @@ static bool warned_unmarked = false;
 
 ScriptHandler::ScriptHandler()
     : game_identifier(),
-      variable_data(VARIABLE_RANGE + 1)
+      variable_data(VARIABLE_RANGE + 1),
+      last_extended_page(NULL),
+      current_token(-1)
 {
     for (int i = 0; i < VARIABLE_RANGE; ++i)
         variable_data[i].owner = this;
@@ -60,7 +61,13 @@ ScriptHandler::ScriptHandler()
     utf_encoding = NULL;
     raw_script_buffer = NULL;
     script_buffer = NULL;
+    script_snapshot_flag = false;
+    script_map = NULL;
+    script_map_length = 0;
     kidoku_buffer = NULL;
+    kidoku_on_disk = false;
+    kidoku_write = NULL;
+    kidoku_thread = NULL;
     label_log.filename = "NScrllog.dat";
     file_log.filename  = "NScrflog.dat";
     clickstr_list.clear();
@@ -91,7 +98,8 @@ ScriptHandler::ScriptHandler()
 ScriptHandler::~ScriptHandler()
 {
     reset();
-    if (script_buffer) delete[] script_buffer;
+    releaseScriptBuffer();
+    waitKidokuData();
     if (kidoku_buffer) delete[] kidoku_buffer;
     if (utf_encoding != file_encoding) delete utf_encoding;
 }
@@ -101,7 +109,8 @@ void ScriptHandler::reset()
 {
     for (int i = 0; i < VARIABLE_RANGE; i++)
         variable_data[i].reset(true);
-    extended_variable_data.clear();
+    extended_variable_pages.clear();
+    last_extended_page = NULL;
 
     arrays.clear();
 
@@ -110,8 +119,9 @@ void ScriptHandler::reset()
     file_log.clear();
 
     // reset aliases
-    num_aliases.clear();
-    str_aliases.clear();
+    for (std::vector<Alias>::iterator i = aliases.begin();
+         i != aliases.end(); ++i)
+        i->num_flag = i->str_flag = false;
 
     // reset misc. variables
     end_status = END_NONE;
@@ -208,19 +218,44 @@ const char* ScriptHandler::readToken(bool no_kidoku)
     current_variable.type = VAR_NONE;
 
     text_flag = false;
+    current_token = -1;
+
+    const CompiledToken* compiled =
+        findCompiled(current_script, CompiledToken::TOKEN);
+    if (compiled) {
+        current_token = compiled - &compiled_tokens[0];
+        if (!no_kidoku) {
+            for (int i = 0; i < 2 && compiled->kidoku[i] >= 0; i++)
+                markAsKidoku(script_buffer + compiled->kidoku[i]);
+        }
+        string_buffer = compiled->text;
+        end_status = compiled->end_status;
+        next_script = script_buffer + compiled->next;
+        return string_buffer;
+    }
 
     SKIP_SPACE(buf);
     if (!no_kidoku) markAsKidoku(buf);
-    
+
+    CompiledToken token;
+    token.kind = CompiledToken::TOKEN;
+    token.command = -1;
+    token.kidoku[0] = buf - script_buffer;
+    token.kidoku[1] = -1;
+    bool cacheable = false;
+
 readTokenTop:
     string_buffer.trunc(0);
     char ch = *buf;
     if (ch == ';') { // comment
-        addStrBuf(ch);
+        const char* start = buf;
         do {
             ch = *++buf;
-            addStrBuf(ch);
         } while (ch != 0x0a && ch != '\0');
+        // The line end is part of the token, as is the terminator if
+        // the script ends in a comment.
+        string_buffer.add(start, buf - start + 1);
+        cacheable = true;
     }
     else if (ch & 0x80
              || (ch >= '0' && ch <= '9')
@@ -335,8 +370,11 @@ readTokenTop:
             }
 
             int bytes;
+            char encoded[8];
             // NOTE: we don't substitute ligatures at this stage.
-            string_buffer += file_encoding->Encode(file_encoding->DecodeChar(buf, bytes));
+            file_encoding->Encode(file_encoding->DecodeChar(buf, bytes),
+                                  encoded);
+            string_buffer += encoded;
             buf += bytes;
             ch = *buf;
         }
@@ -352,23 +390,27 @@ readTokenTop:
     else if ((ch >= 'a' && ch <= 'z')
              || (ch >= 'A' && ch <= 'Z')
              || ch == '_') { // command
+        const char* start = buf;
         do {
-            if (ch >= 'A' && ch <= 'Z') ch += 'a' - 'A';
-
-            string_buffer += ch;
             ch = *++buf;
         }
         while ((ch >= 'a' && ch <= 'z')
                || (ch >= 'A' && ch <= 'Z')
                || (ch >= '0' && ch <= '9')
                || ch == '_');
+        string_buffer.add(start, buf - start);
+        string_buffer.tolower();
+        cacheable = true;
     }
     else if (ch == '*') { // label
         return readLabel();
     }
     else if (ch == '~' || ch == 0x0a || ch == ':') {
         string_buffer += ch;
-        if (!no_kidoku) markAsKidoku(buf++);
+        token.kidoku[1] = buf - script_buffer;
+        if (!no_kidoku) markAsKidoku(buf);
+        buf++;
+        cacheable = true;
     }
     else if (ch != '\0') {
         LOG_F(INFO, "readToken: skip unknown heading character %c (%x)",
@@ -382,12 +424,20 @@ readTokenTop:
     else
         next_script = checkComma(buf);
 
+    if (cacheable) {
+        token.end_status = end_status;
+        token.next = next_script - script_buffer;
+        token.text = string_buffer;
+        current_token = addCompiled(current_script, token);
+    }
+
     return string_buffer;
 }
 
 
 const char* ScriptHandler::readLabel()
 {
+    current_token = -1;
     end_status = END_NONE;
     current_variable.type = VAR_NONE;
 
@@ -543,12 +593,14 @@ int ScriptHandler::getLineByAddress(const char* address, bool absolute)
 {
     LabelInfo label = getLabelByAddress(address);
 
-    const char* addr = label.label_header;
     int line = absolute ? label.start_line + 1 : 0;
-    while (address > addr) {
-        if (*addr == 0x0a) line++;
-
-        addr++;
+    if (address > label.label_header) {
+        // Lines start after each newline, so the number of line starts
+        // up to address, less the first, is the newlines before it.
+        int lines = std::upper_bound(line_starts.begin(), line_starts.end(),
+                                     address - script_buffer)
+                    - line_starts.begin() - 1;
+        line += lines - label.start_line;
     }
     return line;
 }
@@ -558,37 +610,44 @@ const char* ScriptHandler::getAddressByLine(int line)
 {
     LabelInfo label = getLabelByLine(line);
 
-    int l = line - label.start_line;
-    const char* addr = label.label_header;
-    while (l > 0) {
-        while (*addr != 0x0a) addr++;
-        addr++;
-        l--;
-    }
-    return addr;
+    if (line <= label.start_line) return label.label_header;
+    if (line >= (int) line_starts.size())
+        return script_buffer + script_buffer_length;
+    return script_buffer + line_starts[line];
+}
+
+
+static bool startsBefore(const char* address,
+                         const ScriptHandler::LabelInfo& label)
+{
+    return address < label.start_address;
+}
+
+
+static bool lineBefore(int line, const ScriptHandler::LabelInfo& label)
+{
+    return line < label.start_line;
 }
 
 
 ScriptHandler::LabelInfo ScriptHandler::getLabelByAddress(const char* address)
 {
-    LabelInfo::vec::size_type i;
-    for (i = 0; i < label_info.size() - 1; i++) {
-        if (label_info[i + 1].start_address > address)
-            return label_info[i];
-    }
-    return label_info[i];
+    // The last label starting at or before address, or the first.
+    LabelInfo::vec::iterator i =
+        std::upper_bound(label_info.begin(), label_info.end(), address,
+                         startsBefore);
+    if (i != label_info.begin()) --i;
+    return *i;
 }
 
 
 ScriptHandler::LabelInfo ScriptHandler::getLabelByLine(int line)
 {
-    LabelInfo::vec::size_type i;
-    for (i = 0; i < label_info.size() - 1; i++) {
-        if (label_info[i + 1].start_line > line)
-            return label_info[i];
-    }
-
-    return label_info[i];
+    LabelInfo::vec::iterator i =
+        std::upper_bound(label_info.begin(), label_info.end(), line,
+                         lineBefore);
+    if (i != label_info.begin()) --i;
+    return *i;
 }
 
 
@@ -646,10 +705,11 @@ void ScriptHandler::markAsKidoku(const char* address)
     //printf("mark (%c)%x:%x = %d\n", *current_script, offset /8, offset%8, kidoku_buffer[ offset/8 ] & ((char)1 << (offset % 8)));
     if (kidoku_buffer[offset / 8] & ((char) 1 << (offset % 8)))
         skip_enabled = true;
-    else
+    else {
         skip_enabled = false;
-
-    kidoku_buffer[offset / 8] |= ((char) 1 << (offset % 8));
+        kidoku_buffer[offset / 8] |= ((char) 1 << (offset % 8));
+        kidoku_dirty[offset / 8 / KIDOKU_PAGE] = true;
+    }
 }
 
 
@@ -659,17 +719,107 @@ void ScriptHandler::setKidokuskip(bool kidokuskip_flag)
 }
 
 
+// A save in flight: the pages to patch into kidoku.dat, or the whole
+// bitmap if the file has to be written afresh, copied so the main
+// thread can go on marking.
+struct ScriptHandler::KidokuWrite {
+    FILE* fp;                // opened by saveKidokuData, closed here
+    bool whole;
+    size_t length;           // of the whole bitmap
+    std::vector<int> pages;  // page numbers, when patching
+    std::vector<char> data;  // their contents, in order
+    bool ok;
+};
+
+
+int ScriptHandler::kidokuWriteThread(void* data)
+{
+    KidokuWrite* job = (KidokuWrite*) data;
+    FILE* fp = job->fp;
+
+    job->ok = true;
+    if (job->whole) {
+        job->ok = fwrite(job->data.data(), 1, job->length, fp) == job->length;
+    }
+    else {
+        const char* page = job->data.data();
+        for (size_t i = 0; job->ok && i < job->pages.size(); ++i) {
+            const size_t offset = (size_t) job->pages[i] * KIDOKU_PAGE;
+            const size_t len = std::min((size_t) KIDOKU_PAGE,
+                                        job->length - offset);
+            job->ok = fseek(fp, offset, SEEK_SET) == 0 &&
+                fwrite(page, 1, len, fp) == len;
+            page += len;
+        }
+    }
+    if (fclose(fp) != 0) job->ok = false;
+    return 0;
+}
+
+
+void ScriptHandler::waitKidokuData()
+{
+    if (kidoku_thread) {
+        SDL_WaitThread(kidoku_thread, NULL);
+        kidoku_thread = NULL;
+    }
+    if (!kidoku_write) return;
+
+    if (!kidoku_write->ok) {
+        LOG_F(INFO, "can't write kidoku.dat");
+        // Its pages are no longer marked dirty, so write it all next time.
+        kidoku_on_disk = false;
+    }
+    delete kidoku_write;
+    kidoku_write = NULL;
+}
+
+
 void ScriptHandler::saveKidokuData()
 {
-    FILE* fp;
-    pstring fnam = "kidoku.dat";
-    if ((fp = fileopen(fnam, "wb", true, true)) == NULL) {
+    waitKidokuData();
+    if (!kidoku_buffer || script_buffer_length / 8 == 0) return;
+
+    KidokuWrite* job = new KidokuWrite;
+    job->whole = !kidoku_on_disk;
+    job->length = script_buffer_length / 8;
+    if (job->whole) {
+        job->data.assign(kidoku_buffer, kidoku_buffer + job->length);
+    }
+    else {
+        for (size_t i = 0; i < kidoku_dirty.size(); ++i) {
+            if (!kidoku_dirty[i]) continue;
+            const size_t offset = i * KIDOKU_PAGE;
+            if (offset >= job->length) break;
+            const size_t len = std::min((size_t) KIDOKU_PAGE,
+                                        job->length - offset);
+            job->pages.push_back(i);
+            job->data.insert(job->data.end(), kidoku_buffer + offset,
+                             kidoku_buffer + offset + len);
+        }
+        if (job->pages.empty()) {
+            delete job;
+            return;
+        }
+    }
+    // Opened here so fileopen picks the save directory as it does for
+    // every other save file; the writer thread only writes.
+    job->fp = fileopen("kidoku.dat", job->whole ? "wb" : "r+b", true, true);
+    if (!job->fp) {
         LOG_F(INFO, "can't write kidoku.dat");
+        kidoku_on_disk = false;
+        delete job;
         return;
     }
+    kidoku_dirty.assign(kidoku_dirty.size(), false);
+    kidoku_on_disk = true;
 
-    fwrite(kidoku_buffer, 1, script_buffer_length / 8, fp);
-    fclose(fp);
+    kidoku_write = job;
+    kidoku_thread = SDL_CreateThread(kidokuWriteThread, "KidokuWriter", job);
+    if (!kidoku_thread) {
+        kidokuWriteThread(job);
+        waitKidokuData();
+    }
 }
 
 
@@ -678,11 +828,19 @@ void ScriptHandler::loadKidokuData()
     FILE* fp;
     pstring fnam = "kidoku.dat";
     setKidokuskip(true);
+    waitKidokuData();
+    if (kidoku_buffer) delete[] kidoku_buffer;
     kidoku_buffer = new char[script_buffer_length / 8 + 1];
     memset(kidoku_buffer, 0, script_buffer_length / 8 + 1);
+    kidoku_dirty.assign(script_buffer_length / 8 / KIDOKU_PAGE + 1, false);
+    kidoku_on_disk = false;
 
     if ((fp = fileopen(fnam, "rb", true, true)) != NULL) {
-        fread(kidoku_buffer, 1, script_buffer_length / 8, fp);
+        // Only a file of exactly the bitmap's size can be patched.
+        struct stat st;
+        size_t len = fread(kidoku_buffer, 1, script_buffer_length / 8, fp);
+        kidoku_on_disk = len == (size_t) script_buffer_length / 8 &&
+            fstat(fileno(fp), &st) == 0 && st.st_size == (off_t) len;
         fclose(fp);
     }
 }
@@ -763,77 +921,397 @@ pstring ScriptHandler::stringFromInteger(int no, int num_column,
 }
 
 
-int ScriptHandler::readScriptSub(FILE* fp, char** buf, int encrypt_mode, bool is_utf)
+// Decodes one script file into its slot in raw_script_buffer: decrypts
+// it, turns CR and CRLF into LF, drops UTF-8 BOMs, adds a final LF and
+// notes where each line starts.  Touches nothing but the file and the
+// key table, so readScript can run it on several files at once.
+void ScriptHandler::readScriptSub(ScriptFile& file, int encrypt_mode,
+                                  bool is_utf)
 {
-    unsigned char magic[5] = { 0x79, 0x57, 0x0d, 0x80, 0x04 };
-    int  magic_counter = 0;
-    bool cr_flag = false;
-    int bom_check = 0;
-
-    if (encrypt_mode == 3 && !key_table_flag)
-        errorAndExit("readScriptSub: the EXE file must be specified with --key-exe option.");
-
-    size_t len = 0, count = 0;
-    while (1) {
-        if (len == count) {
-            len = fread(tmp_script_buf, 1, TMP_SCRIPT_BUF_LEN, fp);
-            if (len == 0) {
-                if (cr_flag) *(*buf)++ = 0x0a;
-
-                break;
-            }
-
-            count = 0;
-        }
-
-        char ch = tmp_script_buf[count++];
-        if (encrypt_mode == 1) ch ^= 0x84;
-        else if (encrypt_mode == 2) {
-            ch = (ch ^ magic[magic_counter++]) & 0xff;
-            if (magic_counter == 5) magic_counter = 0;
-        }
-        else if (encrypt_mode == 3) {
-            ch = key_table[(unsigned char) ch] ^ 0x84;
-        }
-
-        if (cr_flag && ch != 0x0a) {
-            *(*buf)++    = 0x0a;
-            cr_flag = false;
-        }
-
-        if (ch == 0x0d) {
-            cr_flag = true;
-            continue;
+    static const unsigned char magic[5] = { 0x79, 0x57, 0x0d, 0x80, 0x04 };
+
+    unsigned char* out = (unsigned char*) file.out;
+    const unsigned char* src = file.map;
+    size_t len = file.size;
+    if (!src) {
+        len = fread(out, 1, file.size, file.fp);
+        fclose(file.fp);
+        file.fp = NULL;
+        src = out;
+    }
+
+    // Plain loops over whole files, which compilers vectorize.
+    if (encrypt_mode == 1) {
+        for (size_t i = 0; i < len; ++i) out[i] = src[i] ^ 0x84;
+    }
+    else if (encrypt_mode == 2) {
+        for (size_t i = 0, m = 0; i < len; ++i) {
+            out[i] = src[i] ^ magic[m];
+            if (++m == 5) m = 0;
         }
+    }
+    else if (encrypt_mode == 3) {
+        for (size_t i = 0; i < len; ++i) out[i] = key_table[src[i]] ^ 0x84;
+    }
+    else if (src != out) {
+        memcpy(out, src, len);
+    }
 
-        if (ch == 0x0a) {
-            *(*buf)++    = 0x0a;
-            cr_flag = false;
-        }
-        else {
-            *(*buf)++ = ch;
-        }
+#ifdef USE_MMAP_ARCHIVES
+    if (file.map) munmap((void*) file.map, file.size);
+    file.map = NULL;
+#endif
 
-        if (is_utf) {
-            //check for UTF-8 BOM and skip it
+    // A CR becomes LF, unless an LF follows it, in which case it goes.
+    char* dst = file.out;
+    const char* p = file.out;
+    const char* end = file.out + len;
+    const char* cr;
+    while ((cr = (const char*) memchr(p, 0x0d, end - p)) != NULL) {
+        memmove(dst, p, cr - p);
+        dst += cr - p;
+        *dst++ = 0x0a;
+        p = cr + 1;
+        if (p < end && *p == 0x0a) ++p;
+    }
+    memmove(dst, p, end - p);
+    dst += end - p;
+
+    if (is_utf && memchr(file.out, 0xef, dst - file.out)) {
+        //check for UTF-8 BOM and skip it
+        char* q = file.out;
+        int bom_check = 0;
+        for (const char* r = file.out; r < dst; ++r) {
+            char ch = *q++ = *r;
             if ((ch == char(0xef)) && (bom_check == 0))
                 bom_check = 1;
             else if ((ch == char(0xbb)) && (bom_check == 1))
                 bom_check = 2;
             else if ((ch == char(0xbf)) && (bom_check == 2)) {
-                //LOG_F(INFO,"readScriptSub: found UTF-8 BOM, backtracking");
-                *buf -= 3;
+                q -= 3;
                 bom_check = 0;
             } else
                 bom_check = 0;
         }
+        dst = q;
+    }
+
+    *dst++ = 0x0a;
+    file.length = dst - file.out;
+
+    file.lines.clear();
+    for (p = file.out; p < dst; ++p) {
+        p = (const char*) memchr(p, 0x0a, dst - p);
+        file.lines.push_back(p + 1 - file.out);
     }
+}
+
+
+struct ScriptHandler::ScriptLoad {
+    ScriptHandler* sh;
+    std::vector<ScriptFile>* files;
+    int encrypt_mode;
+    bool is_utf;
+    SDL_atomic_t next;
+};
 
-    *(*buf)++ = 0x0a;
+
+int ScriptHandler::readScriptThread(void* data)
+{
+    ScriptLoad* load = (ScriptLoad*) data;
+    int i;
+    while ((i = SDL_AtomicAdd(&load->next, 1)) < (int) load->files->size())
+        load->sh->readScriptSub((*load->files)[i], load->encrypt_mode,
+                                load->is_utf);
     return 0;
 }
 
 
+// Maps or reads the files, decodes them in parallel, each into its own
+// slot of a new script buffer, then closes up the slots and the line
+// table with them.  Returns the end of the script.
+char* ScriptHandler::decodeScript(std::vector<ScriptFile>& files,
+                                  size_t length, int encrypt_mode,
+                                  bool is_utf)
+{
+#ifdef USE_MMAP_ARCHIVES
+    for (size_t i = 0; i < files.size(); ++i) {
+        ScriptFile& file = files[i];
+        if (!file.size) continue;
+        void* map = mmap(NULL, file.size, PROT_READ, MAP_SHARED,
+                         fileno(file.fp), 0);
+        if (map != MAP_FAILED) {
+            file.map = (const unsigned char*) map;
+            fclose(file.fp);
+            file.fp = NULL;
+        }
+    }
+#endif
+
+    raw_script_buffer = new char[length];
+
+    char* slot = raw_script_buffer;
+    for (size_t i = 0; i < files.size(); ++i) {
+        files[i].out = slot;
+        slot += files[i].size + 1;
+    }
+
+    ScriptLoad load;
+    load.sh = this;
+    load.files = &files;
+    load.encrypt_mode = encrypt_mode;
+    load.is_utf = is_utf;
+    SDL_AtomicSet(&load.next, 0);
+
+    // This thread decodes too, so only start helpers for other files.
+    std::vector<SDL_Thread*> threads;
+    int helpers = std::min(SDL_GetCPUCount() - 1, (int) files.size() - 1);
+    for (int i = 0; i < helpers; i++) {
+        SDL_Thread* thread =
+            SDL_CreateThread(readScriptThread, "ScriptLoader", &load);
+        if (thread) threads.push_back(thread);
+    }
+    readScriptThread(&load);
+    for (size_t i = 0; i < threads.size(); ++i)
+        SDL_WaitThread(threads[i], NULL);
+
+    char* end = raw_script_buffer;
+    line_starts.clear();
+    line_starts.push_back(0);
+    for (size_t i = 0; i < files.size(); ++i) {
+        const ScriptFile& file = files[i];
+        if (file.out != end) memmove(end, file.out, file.length);
+        const int base = end - raw_script_buffer;
+        for (size_t j = 0; j < file.lines.size(); ++j)
+            line_starts.push_back(base + file.lines[j]);
+        end += file.length;
+    }
+    return end;
+}
+
+
+void ScriptHandler::releaseScriptBuffer()
+{
+    if (script_map) {
+#ifdef USE_MMAP_ARCHIVES
+        munmap(script_map, script_map_length);
+#else
+        delete[] script_map;
+#endif
+        script_map = NULL;
+    }
+    else if (raw_script_buffer) {
+        delete[] raw_script_buffer;
+    }
+    raw_script_buffer = script_buffer = NULL;
+}
+
+
+// A script snapshot is a header, the decoded script (padded to eight
+// bytes), the line table, fixed-size label records and the label names.
+#define SCRIPT_SNAPSHOT_MAGIC "PNSSCR01"
+
+struct ScriptSnapshotHeader {
+    char magic[8];
+    Uint64 key;           // scriptSnapshotKey()
+    Uint32 script_length;
+    Uint32 num_of_lines;  // line_starts entries
+    Uint32 num_of_labels;
+    Uint32 names_length;
+};
+
+struct ScriptSnapshotLabel {
+    Uint32 name_offset, name_length;
+    Uint32 header, start; // script offsets
+    Uint32 start_line, num_of_lines;
+};
+
+
+pstring ScriptHandler::scriptSnapshotPath(const pstring& script_dir) const
+{
+    pstring path;
+    path.format("scriptcache_%08x.dat",
+                (unsigned int) pstring_hash()(script_dir));
+    return (save_path ? save_path : script_dir) + path;
+}
+
+
+// What the decoded script depends on: where the files are and how they
+// are read, and each file's name, size and mtime.
+Uint64 ScriptHandler::scriptSnapshotKey(const pstring& script_dir,
+                                        const std::vector<ScriptFile>& files,
+                                        int encrypt_mode,
+                                        encoding_t enc) const
+{
+    pstring key = script_dir;
+    key += (char) encrypt_mode;
+    key += (char) enc;
+    if (encrypt_mode == 3) key += pstring((const char*) key_table, 256);
+    for (size_t i = 0; i < files.size(); ++i) {
+        const Uint64 size = files[i].size;
+        key += files[i].name;
+        key += pstring((const char*) &size, sizeof(size));
+        key += pstring((const char*) &files[i].mtime, sizeof(files[i].mtime));
+    }
+    return pstring_hash()(key);
+}
+
+
+bool ScriptHandler::loadScriptSnapshot(const pstring& path, Uint64 key)
+{
+    FILE* fp = fopen(path, "rb");
+    if (!fp) return false;
+
+    struct stat st;
+    if (fstat(fileno(fp), &st) != 0 ||
+        (size_t) st.st_size < sizeof(ScriptSnapshotHeader)) {
+        fclose(fp);
+        return false;
+    }
+    size_t size = st.st_size;
+
+    // Mapped privately and writable, so the script can be used in place
+    // just as if it had been decoded into the heap.
+#ifdef USE_MMAP_ARCHIVES
+    void* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                     fileno(fp), 0);
+    fclose(fp);
+    if (map == MAP_FAILED) return false;
+    char* data = (char*) map;
+#else
+    char* data = new char[size];
+    size_t len = fread(data, 1, size, fp);
+    fclose(fp);
+    if (len != size) {
+        delete[] data;
+        return false;
+    }
+#endif
+
+    const ScriptSnapshotHeader* header = (const ScriptSnapshotHeader*) data;
+    char* script = data + sizeof(ScriptSnapshotHeader);
+    const Uint64 script_length = (header->script_length + 7) & ~7ULL;
+    const Uint32* lines = (const Uint32*) (script + script_length);
+    const ScriptSnapshotLabel* labels =
+        (const ScriptSnapshotLabel*) (lines + header->num_of_lines);
+    const char* names = (const char*) (labels + header->num_of_labels);
+
+    bool valid =
+        !memcmp(header->magic, SCRIPT_SNAPSHOT_MAGIC, sizeof(header->magic)) &&
+        header->key == key &&
+        header->script_length > 0 && header->script_length <= INT_MAX &&
+        header->num_of_lines > 0 &&
+        size == sizeof(ScriptSnapshotHeader) + script_length
+              + (Uint64) header->num_of_lines * sizeof(Uint32)
+              + (Uint64) header->num_of_labels * sizeof(ScriptSnapshotLabel)
+              + header->names_length &&
+        script[header->script_length - 1] == 0x0a &&
+        lines[0] == 0 && lines[header->num_of_lines - 1] == header->script_length;
+
+    for (Uint32 i = 1; valid && i < header->num_of_lines; i++)
+        valid = lines[i - 1] < lines[i];
+
+    for (Uint32 i = 0; valid && i < header->num_of_labels; i++) {
+        const ScriptSnapshotLabel& l = labels[i];
+        valid = l.name_offset <= header->names_length &&
+            l.name_length <= header->names_length - l.name_offset &&
+            l.header < header->script_length &&
+            l.start <= header->script_length &&
+            l.start_line < header->num_of_lines;
+    }
+
+    if (!valid) {
+#ifdef USE_MMAP_ARCHIVES
+        munmap(map, size);
+#else
+        delete[] data;
+#endif
+        return false;
+    }
+
+    script_map = data;
+    script_map_length = size;
+    raw_script_buffer = script;
+    script_buffer_length = header->script_length;
+
+    line_starts.assign(lines, lines + header->num_of_lines);
+
+    label_info.clear();
+    label_info.resize(header->num_of_labels);
+    for (Uint32 i = 0; i < header->num_of_labels; i++) {
+        LabelInfo& label = label_info[i];
+        label.name = pstring(names + labels[i].name_offset,
+                             labels[i].name_length);
+        label.label_header = script + labels[i].header;
+        label.start_address = script + labels[i].start;
+        label.start_line = labels[i].start_line;
+        label.num_of_lines = labels[i].num_of_lines;
+    }
+    for (LabelInfo::iterator i = label_info.begin(); i != label_info.end(); ++i)
+	label_names[i->name] = i;
+
+    return true;
+}
+
+
+void ScriptHandler::saveScriptSnapshot(const pstring& path, Uint64 key)
+{
+    ScriptSnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SCRIPT_SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.key = key;
+    header.script_length = script_buffer_length;
+    header.num_of_lines = line_starts.size();
+    header.num_of_labels = label_info.size();
+
+    std::vector<Uint32> lines(line_starts.begin(), line_starts.end());
+    std::vector<ScriptSnapshotLabel> labels(label_info.size());
+    pstring names;
+    for (size_t i = 0; i < label_info.size(); i++) {
+        const LabelInfo& label = label_info[i];
+        labels[i].name_offset = names.length();
+        labels[i].name_length = label.name.length();
+        labels[i].header = label.label_header - script_buffer;
+        labels[i].start = label.start_address - script_buffer;
+        labels[i].start_line = label.start_line;
+        labels[i].num_of_lines = label.num_of_lines;
+        names += label.name;
+    }
+    header.names_length = names.length();
+
+    static const char padding[8] = { 0 };
+    const size_t pad = (8 - script_buffer_length % 8) % 8;
+
+    // Write to a temporary name and move it into place, so a reader
+    // never sees half a snapshot.
+    pstring tmp_path = path + ".tmp";
+    FILE* fp = fopen(tmp_path, "wb");
+    if (!fp) return;
+
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+        fwrite(script_buffer, 1, script_buffer_length, fp)
+            == (size_t) script_buffer_length &&
+        fwrite(padding, 1, pad, fp) == pad &&
+        fwrite(&lines[0], sizeof(Uint32), lines.size(), fp) == lines.size();
+    if (ok && !labels.empty())
+        ok = fwrite(&labels[0], sizeof(ScriptSnapshotLabel), labels.size(), fp)
+             == labels.size();
+    if (ok)
+        ok = fwrite((const char*) names, 1, names.length(), fp)
+             == (size_t) names.length();
+    if (fclose(fp) != 0) ok = false;
+
+    if (ok) {
+        remove(path);
+        ok = rename(tmp_path, path) == 0;
+    }
+    if (!ok) {
+        LOG_F(INFO, "can't write script snapshot %s", (const char*) path);
+        remove(tmp_path);
+    }
+}
+
+
 int ScriptHandler::readScript(DirPaths *path, const char* prefer_name)
 {
     archive_path = path;
@@ -844,6 +1322,7 @@ int ScriptHandler::readScript(DirPaths *path, const char* prefer_name)
 
     pstring fname = "";
     pstring ext = "";
+    pstring script_name = "";
     while ((fp == NULL) && (n<archive_path->get_num_paths())) {
         script_path = archive_path->get_path(n++);
 
@@ -890,6 +1369,7 @@ int ScriptHandler::readScript(DirPaths *path, const char* prefer_name)
             for (ScriptFilename::iterator ft = script_filenames.begin();
                  ft != script_filenames.end(); ++ft) {
                 if ((fp = fileopen(script_path, ft->filename, "rb")) != NULL) {
+                    script_name = ft->filename;
                     ext = pstr_split_last(ft->filename, '.').second;
                     encrypt_mode = ft->encryption;
                     enc = ft->_encoding;
@@ -918,12 +1398,20 @@ int ScriptHandler::readScript(DirPaths *path, const char* prefer_name)
         is_ponscripter = false;
     }
     
-    fseek(fp, 0, SEEK_END);
-    int estimated_buffer_length = ftell(fp) + 1;
+    if (encrypt_mode == 3 && !key_table_flag)
+        errorAndExit("readScriptSub: the EXE file must be specified with --key-exe option.");
 
-    if (encrypt_mode == 0 && !fname) {
+    // Open every file first, since fileopen isn't safe off the main
+    // thread; they are then decoded in parallel by decodeScript.
+    std::vector<ScriptFile> files;
+    if (encrypt_mode > 0 || fname) {
+        files.push_back(ScriptFile());
+        files.back().name = fname ? fname : script_name;
+        files.back().fp = fp;
+    }
+    else {
         fclose(fp);
-        for (int i = 1; i < 100; i++) {
+        for (int i = 0; i < 100; i++) {
             pstring filename;
             filename.format("%d.%s", i, (const char*)ext);
             if ((fp = fileopen(script_path, filename, "rb")) == NULL) {
@@ -932,42 +1420,51 @@ int ScriptHandler::readScript(DirPaths *path, const char* prefer_name)
             }
 
             if (fp) {
-                fseek(fp, 0, SEEK_END);
-                estimated_buffer_length += ftell(fp) + 1;
-                fclose(fp);
+                files.push_back(ScriptFile());
+                files.back().name = filename;
+                files.back().fp = fp;
             }
         }
     }
 
-    if (raw_script_buffer) delete[] raw_script_buffer;
+    size_t estimated_buffer_length = 0;
+    for (size_t i = 0; i < files.size(); ++i) {
+        ScriptFile& file = files[i];
+        struct stat st;
+        bool ok = fstat(fileno(file.fp), &st) == 0;
+        file.size = ok && st.st_size > 0 ? st.st_size : 0;
+        file.mtime = ok ? st.st_mtime : 0;
+        file.map = NULL;
+        estimated_buffer_length += file.size + 1;
+    }
 
-    char* p_script_buffer = new char[estimated_buffer_length];
+    releaseScriptBuffer();
 
-    current_script = raw_script_buffer = p_script_buffer;
-    tmp_script_buf = new char[TMP_SCRIPT_BUF_LEN];
+    pstring script_dir = script_path;
+    if (fname) {
+        int i = fname.reversefind(DELIMITER, fname.length());
+        script_dir = i >= 0 ? fname.midstr(0, i + 1) : pstring("");
+    }
+    pstring snapshot_path;
+    Uint64 snapshot_key = 0;
+    bool from_snapshot = false;
+    if (script_snapshot_flag) {
+        snapshot_path = scriptSnapshotPath(script_dir);
+        snapshot_key = scriptSnapshotKey(script_dir, files, encrypt_mode, enc);
+        from_snapshot = loadScriptSnapshot(snapshot_path, snapshot_key);
+    }
 
-    if (encrypt_mode > 0 || fname) {
-        fseek(fp, 0, SEEK_SET);
-        readScriptSub(fp, &p_script_buffer, encrypt_mode);
-        fclose(fp);
+    char* p_script_buffer;
+    if (from_snapshot) {
+        for (size_t i = 0; i < files.size(); ++i) fclose(files[i].fp);
+        p_script_buffer = raw_script_buffer + script_buffer_length;
     }
     else {
-        for (int i = 0; i < 100; i++) {
-            pstring filename;
-            filename.format("%d.%s", i, (const char*)ext);
-            if ((fp = fileopen(script_path, filename, "rb")) == NULL) {
-                filename.format("%02d.%s", i, (const char*)ext);
-                fp = fileopen(script_path, filename, "rb");
-            }
-
-            if (fp) {
-                readScriptSub(fp, &p_script_buffer, 0, (enc == UTF8));
-                fclose(fp);
-            }
-        }
+        p_script_buffer = decodeScript(files, estimated_buffer_length,
+                                       encrypt_mode,
+                                       encrypt_mode == 0 && !fname && enc == UTF8);
     }
-
-    delete[] tmp_script_buf;
+    current_script = raw_script_buffer;
 
     script_buffer = raw_script_buffer;
 
@@ -1082,7 +1579,14 @@ int ScriptHandler::readScript(DirPaths *path, const char* prefer_name)
         buf = end + 1;
     }
 
-    return labelScript();
+    if (from_snapshot) {
+        clearCompiledTokens();
+        return 0;
+    }
+
+    int ret = labelScript();
+    if (script_snapshot_flag) saveScriptSnapshot(snapshot_path, snapshot_key);
+    return ret;
 }
 
 
@@ -1116,20 +1620,95 @@ int ScriptHandler::labelScript()
 	    if (label_info.size())
 		label_info.back().num_of_lines++;
 
-            while (*buf != 0x0a) buf++;
-            buf++;
-            current_line++;
+            // readScript has already found where every line ends.
+            buf = script_buffer + line_starts[++current_line];
         }
     }
 
     // Index label names.
     for (LabelInfo::iterator i = label_info.begin(); i != label_info.end(); ++i)
 	label_names[i->name] = i;
-    
+
+    clearCompiledTokens();
+
     return 0;
 }
 
 
+void ScriptHandler::clearCompiledTokens()
+{
+    compiled_tokens.clear();
+    compiled_pages.clear();
+    current_token = -1;
+    compiled_pages.resize(script_buffer_length / TOKEN_CACHE_PAGE + 1);
+}
+
+
+const ScriptHandler::CompiledToken*
+ScriptHandler::findCompiled(const char* pos, int kind) const
+{
+    // Strings run with pushCurrent lie outside the script.
+    if (pos < script_buffer || pos >= script_buffer + script_buffer_length)
+        return NULL;
+
+    int offset = pos - script_buffer;
+    const std::vector<int>& page = compiled_pages[offset / TOKEN_CACHE_PAGE];
+    if (page.empty()) return NULL;
+
+    int index = page[offset % TOKEN_CACHE_PAGE];
+    if (index == 0 || compiled_tokens[index - 1].kind != kind) return NULL;
+
+    return &compiled_tokens[index - 1];
+}
+
+
+int ScriptHandler::addCompiled(const char* pos, const CompiledToken& token)
+{
+    if (pos < script_buffer || pos >= script_buffer + script_buffer_length)
+        return -1;
+
+    int offset = pos - script_buffer;
+    std::vector<int>& page = compiled_pages[offset / TOKEN_CACHE_PAGE];
+    if (page.empty()) page.resize(TOKEN_CACHE_PAGE);
+
+    int& index = page[offset % TOKEN_CACHE_PAGE];
+    if (index == 0) {
+        compiled_tokens.push_back(token);
+        index = compiled_tokens.size();
+    }
+    else if (compiled_tokens[index - 1].kind != token.kind)
+        return -1;
+
+    return index - 1;
+}
+
+
+ScriptHandler::CompiledToken* ScriptHandler::currentCommand()
+{
+    // Anything read since readToken moves current_script on.
+    if (current_token < 0 ||
+        findCompiled(current_script, CompiledToken::TOKEN)
+            != &compiled_tokens[current_token])
+        return NULL;
+
+    return &compiled_tokens[current_token];
+}
+
+
+int ScriptHandler::getCommandId()
+{
+    CompiledToken* token = currentCommand();
+    return token ? token->command : -1;
+}
+
+
+void ScriptHandler::setCommandId(int id)
+{
+    CompiledToken* token = currentCommand();
+    if (token) token->command = id;
+}
+
+
 ScriptHandler::LabelInfo ScriptHandler::lookupLabel(const pstring& label)
 {
     LabelInfo::iterator i = findLabel(label);
@@ -1170,16 +1749,20 @@ ScriptHandler::VariableData &ScriptHandler::getVariableData(int no)
     if (no >= 0 && no < VARIABLE_RANGE)
         return variable_data[no];
 
-    for (size_t i=0 ; i<extended_variable_data.size() ; i++) {
-        if (extended_variable_data[i].no == no) 
-            return extended_variable_data[i].vd;
+    // Arithmetic shift, so negative numbers get pages of their own.
+    int page_no = no >> EXTENDED_PAGE_BITS;
+    if (!last_extended_page || last_extended_page_no != page_no) {
+        std::vector<VariableData>& page = extended_variable_pages[page_no];
+        if (page.empty()) {
+            page.resize(EXTENDED_PAGE_SIZE);
+            for (int i = 0; i < EXTENDED_PAGE_SIZE; ++i)
+                page[i].owner = this;
+        }
+        last_extended_page_no = page_no;
+        last_extended_page = &page;
     }
-    extended_variable_data.push_back(ExtendedVariableData(no));
-    //printf("SHandler.getVariableData: adding extended variable for var no %d "
-    //       "(vector size/capacity is now %d/%d\n", no, 
-    //       extended_variable_data.size(), extended_variable_data.capacity());
 
-    return extended_variable_data.back().vd;
+    return (*last_extended_page)[no & (EXTENDED_PAGE_SIZE - 1)];
 }
 
 
@@ -1310,6 +1893,20 @@ pstring ScriptHandler::parseStr(const char** buf)
         return s;
     }
     else { // bareword
+        const CompiledToken* compiled =
+            findCompiled(*buf, CompiledToken::STR_ALIAS);
+        if (compiled) {
+            const Alias& alias = aliases[compiled->value];
+            *buf = script_buffer + compiled->next;
+            if (!alias.str_flag) {
+                current_variable.type = VAR_NONE;
+                return alias.name;
+            }
+            current_variable.type |= VAR_CONST;
+            return alias.str;
+        }
+        const char* alias_start = *buf;
+
         char ch;
         pstring alias_buf;
         bool first_flag = true;
@@ -1343,14 +1940,23 @@ pstring ScriptHandler::parseStr(const char** buf)
             return "";
         }
 
-	stralias_t::iterator a = str_aliases.find(alias_buf);
-	if (a == str_aliases.end()) {
+        CompiledToken token;
+        token.kind = CompiledToken::STR_ALIAS;
+        token.end_status = END_NONE;
+        token.next = *buf - script_buffer;
+        token.kidoku[0] = token.kidoku[1] = -1;
+        token.value = aliasId(alias_buf);
+        token.command = -1;
+        addCompiled(alias_start, token);
+
+        const Alias& alias = aliases[token.value];
+	if (!alias.str_flag) {
             current_variable.type = VAR_NONE;
 	    return alias_buf;
 	}
 
         current_variable.type |= VAR_CONST;
-	return a->second;
+	return alias.str;
     }
 }
 
@@ -1381,6 +1987,21 @@ int ScriptHandler::parseInt(const char** buf)
 	return 0;
     }
     else {
+        const CompiledToken* compiled =
+            findCompiled(*buf, CompiledToken::INT_LITERAL);
+        if (compiled) {
+            current_variable.type = VAR_INT | VAR_CONST;
+            *buf = script_buffer + compiled->next;
+            return compiled->value;
+        }
+        compiled = findCompiled(*buf, CompiledToken::NUM_ALIAS);
+        if (compiled && aliases[compiled->value].num_flag) {
+            current_variable.type = VAR_INT | VAR_CONST;
+            *buf = script_buffer + compiled->next;
+            return aliases[compiled->value].num;
+        }
+        const char* literal_start = *buf;
+
         char ch;
 	pstring alias_buf;
         int alias_no = 0;
@@ -1427,10 +2048,11 @@ int ScriptHandler::parseInt(const char** buf)
 
         /* ---------------------------------------- */
         /* Solve num aliases */
+        int alias_id = -1;
         if (num_alias_flag) {
-
-	    numalias_t::iterator a = num_aliases.find(alias_buf);
-	    if (a == num_aliases.end()) {
+            alias_id = aliasId(alias_buf);
+            const Alias& a = aliases[alias_id];
+	    if (!a.num_flag) {
                 LOG_F(INFO, "can't find num alias for %s... assume 0.",
 		       (const char*) alias_buf);
                 current_variable.type = VAR_NONE;
@@ -1438,12 +2060,23 @@ int ScriptHandler::parseInt(const char** buf)
                 return 0;
 	    }
 	    else {
-		alias_no = a->second;
+		alias_no = a.num;
 	    }
         }
 
         current_variable.type = VAR_INT | VAR_CONST;
         ret = alias_no;
+
+        SKIP_SPACE(*buf);
+        CompiledToken token;
+        token.kind = num_alias_flag ? CompiledToken::NUM_ALIAS
+                                    : CompiledToken::INT_LITERAL;
+        token.end_status = END_NONE;
+        token.next = *buf - script_buffer;
+        token.kidoku[0] = token.kidoku[1] = -1;
+        token.value = num_alias_flag ? alias_id : ret;
+        token.command = -1;
+        addCompiled(literal_start, token);
     }
 
     SKIP_SPACE(*buf);
@@ -1581,6 +2214,8 @@ ScriptHandler::array_ref ScriptHandler::parseArray(const char** buf)
     
     while (**buf == '[') {
         (*buf)++;
+        if (indices.size() == h_index_t::MAX_DIMENSIONS)
+            errorAndExit("parseArray: too many dimensions.");
 	indices.push_back(parseIntExpression(buf));
         SKIP_SPACE(*buf);
         if (**buf != ']') errorAndExit("parseArray: no ']' is found.");
@@ -1726,3 +2361,38 @@ void ScriptHandler::checkalias(const pstring& alias)
     if (dodgy.aliases.find(alias) != dodgy.aliases.end())
 	LOG_F(WARNING, "Warning: alias `%s' may conflict with some barewords", (const char*) alias);
 }
+
+
+int ScriptHandler::aliasId(const pstring& alias)
+{
+    dictionary<pstring, int>::t::iterator i = alias_ids.find(alias);
+    if (i != alias_ids.end()) return i->second;
+
+    aliases.push_back(Alias(alias));
+    return alias_ids[alias] = aliases.size() - 1;
+}
+
+
+const ScriptHandler::Alias* ScriptHandler::findAlias(const pstring& alias) const
+{
+    dictionary<pstring, int>::t::const_iterator i = alias_ids.find(alias);
+    return i == alias_ids.end() ? NULL : &aliases[i->second];
+}
+
+
+void ScriptHandler::addNumAlias(const pstring& str, int val)
+{
+    checkalias(str);
+    Alias& a = aliases[aliasId(str)];
+    a.num_flag = true;
+    a.num = val;
+}
+
+
+void ScriptHandler::addStrAlias(const pstring& str, const pstring& val)
+{
+    checkalias(str);
+    Alias& a = aliases[aliasId(str)];
+    a.str_flag = true;
+    a.str = val;
+}
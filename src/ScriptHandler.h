@@ -34,6 +34,7 @@
 #include <loguru.hpp>
 
 const int VARIABLE_RANGE = 4096;
+const int TOKEN_CACHE_PAGE = 1024; // script bytes per token cache page
 
 class ScriptHandler {
 public:
@@ -80,12 +81,12 @@ public:
 	
 	ArrayVariable(ScriptHandler* o, h_index_t sizes);
 
-	h_index_t::iterator begin() { return data.begin(); }
-	h_index_t::iterator end()   { return data.end(); }
+	std::vector<int>::iterator begin() { return data.begin(); }
+	std::vector<int>::iterator end()   { return data.end(); }
     private:
 	ScriptHandler* owner;
         h_index_t dim;
-	h_index_t data;
+	std::vector<int> data; // row-major
 	int& getoffs(const h_index_t& indices);
     };
     ArrayVariable::map arrays;
@@ -113,6 +114,11 @@ public:
     FILE *fileopen(const pstring& root, const pstring& path, const char *mode);
     void setKeyTable(const unsigned char* key_table);
 
+    // Keep a snapshot of the loaded script, labels and line index, so
+    // the next readScript of unchanged files can map it instead of
+    // decoding and labelling the script again.  Off by default.
+    void enableScriptSnapshot() { script_snapshot_flag = true; }
+
     void setSavedir(const pstring& dir);
 
     // basic parser function
@@ -176,6 +182,12 @@ public:
     LabelInfo getLabelByLine(int line);
 
     bool isText();
+
+    // Dense command number cached with the token readToken just read,
+    // or -1 if it has none yet or the token isn't a cached command.
+    int getCommandId();
+    void setCommandId(int id);
+
     //Mion: using these since 'isdigit' & 'isxdigit' behavior
     //      are locale-specific (at least on Windows)
     static inline bool isawspace(int c) { return ((c == ' ') || (c == '\t')); }
@@ -197,6 +209,7 @@ public:
     void setKidokuskip(bool kidokuskip_flag);
     void saveKidokuData();
     void loadKidokuData();
+    void waitKidokuData();
 
     void addStrVariable(const char** buf);
     void addIntVariable(const char** buf);
@@ -211,7 +224,6 @@ public:
     pstring stringFromInteger(int no, int num_column,
 			     bool is_zero_inserted = false, bool do_wide = false);
     
-    int readScriptSub(FILE* fp, char** buf, int encrypt_mode, bool is_utf=false);
     int readScript(DirPaths *path, const char* prefer_name);
     int labelScript();
 
@@ -222,10 +234,8 @@ public:
 
     void loadArrayVariable(FILE* fp);
 
-    void addNumAlias(const pstring& str, int val)
-	{ checkalias(str); num_aliases[str] = val; }
-    void addStrAlias(const pstring& str, const pstring& val)
-	{ checkalias(str); str_aliases[str] = val; }
+    void addNumAlias(const pstring& str, int val);
+    void addStrAlias(const pstring& str, const pstring& val);
 
 
     class LogInfo {
@@ -326,34 +336,114 @@ private:
     /* ---------------------------------------- */
     /* Variable */
     std::vector<VariableData> variable_data;
-    struct ExtendedVariableData{
-        int no;
-        VariableData vd;
-        ExtendedVariableData(int n): no(n) {}
+    // Variables outside 0..VARIABLE_RANGE, in pages allocated the first
+    // time one of their variables is used.  Pages never move, so
+    // references from getVariableData stay valid.
+    enum { EXTENDED_PAGE_BITS = 8,
+           EXTENDED_PAGE_SIZE = 1 << EXTENDED_PAGE_BITS };
+    typedef std::unordered_map<int, std::vector<VariableData> >
+        extended_pages_t;
+    extended_pages_t extended_variable_pages;
+    int last_extended_page_no;
+    std::vector<VariableData>* last_extended_page;
+
+    // Alias names are interned: each gets a number the first time it
+    // is defined or looked up, and keeps it across resets, so the token
+    // cache can remember which alias a script position refers to.
+    struct Alias {
+        pstring name;
+        bool num_flag, str_flag; // defined with numalias, stralias
+        int num;
+        pstring str;
+        Alias(const pstring& n) : name(n), num_flag(false), str_flag(false) {}
     };
-    std::vector<ExtendedVariableData> extended_variable_data;
-
-    typedef dictionary<pstring, int>::t    numalias_t;
-    typedef dictionary<pstring, pstring>::t stralias_t;
+    std::vector<Alias> aliases;
+    dictionary<pstring, int>::t alias_ids;
     void checkalias(const pstring& alias);// warns if an alias may cause trouble
-    numalias_t num_aliases;
-    stralias_t str_aliases;
+    int aliasId(const pstring& alias);
+    const Alias* findAlias(const pstring& alias) const;
 
     DirPaths *archive_path;
     int   script_buffer_length;
     char* raw_script_buffer;
     char* script_buffer;
-    char* tmp_script_buf;
+
+    // One script file as readScript loads it: opened, and mapped where
+    // the platform allows, on the main thread, then decoded by whichever
+    // loader thread gets to it.
+    struct ScriptFile {
+        pstring name;
+        FILE* fp;                 // NULL once mapped
+        const unsigned char* map; // NULL unless memory-mapped
+        size_t size;
+        Sint64 mtime;
+        char* out;                // slot in raw_script_buffer, size + 1 long
+        size_t length;            // bytes decoded, final 0x0a included
+        std::vector<int> lines;   // offsets in out just past each 0x0a
+    };
+    struct ScriptLoad;
+    void readScriptSub(ScriptFile& file, int encrypt_mode, bool is_utf);
+    static int readScriptThread(void* data);
+    char* decodeScript(std::vector<ScriptFile>& files, size_t length,
+                       int encrypt_mode, bool is_utf);
+    void releaseScriptBuffer();
+
+    bool script_snapshot_flag;
+    char* script_map;         // the snapshot holding the script, if any
+    size_t script_map_length;
+    pstring scriptSnapshotPath(const pstring& script_dir) const;
+    Uint64 scriptSnapshotKey(const pstring& script_dir,
+                             const std::vector<ScriptFile>& files,
+                             int encrypt_mode, encoding_t enc) const;
+    bool loadScriptSnapshot(const pstring& path, Uint64 key);
+    void saveScriptSnapshot(const pstring& path, Uint64 key);
 
     pstring string_buffer; // updated only by readToken (is this true?)
 
     LabelInfo::vec label_info;
     LabelInfo::dic label_names;
+    std::vector<int> line_starts; // script offset of each line, in order
+
+    // Tokens that lex the same way every time, compiled the first time
+    // they are read so loops don't re-lex their lines: commands,
+    // comments, line ends, ':' and '~' from readToken, and integer
+    // literals from parseInt.  Text is always read from the script, as
+    // it depends on variables and on textgosub.  Entries are found by
+    // script offset through pages that are allocated on first use.
+    struct CompiledToken {
+        enum { TOKEN, INT_LITERAL, NUM_ALIAS, STR_ALIAS };
+        int kind;
+        int end_status;
+        int next;         // offset of the following token
+        int kidoku[2];    // offsets readToken marks as read, or -1
+        int value;        // INT_LITERAL, or alias number
+        int command;      // TOKEN: see setCommandId
+        pstring text;     // TOKEN: the token as readToken returns it
+    };
+    std::vector<CompiledToken> compiled_tokens;
+    std::vector<std::vector<int> > compiled_pages; // index + 1, or 0
+    int current_token; // index of the token readToken returned, or -1
+
+    void clearCompiledTokens();
+    const CompiledToken* findCompiled(const char* pos, int kind) const;
+    int addCompiled(const char* pos, const CompiledToken& token);
+    CompiledToken* currentCommand();
     
     bool  skip_enabled;
     bool  kidokuskip_flag;
     char* kidoku_buffer;
 
+    // Pages of kidoku_buffer changed since the last save.  Once
+    // kidoku.dat holds the whole bitmap, a save patches just these
+    // pages, and the writing is done on a thread of its own.
+    enum { KIDOKU_PAGE = 4096 };
+    std::vector<bool> kidoku_dirty;
+    bool kidoku_on_disk;
+    struct KidokuWrite;
+    KidokuWrite* kidoku_write;
+    SDL_Thread* kidoku_thread;
+    static int kidokuWriteThread(void* data);
+
     bool  text_flag; // true if the current token is text
     int   end_status;
     bool  linepage_flag;
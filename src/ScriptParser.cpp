@@ -51,12 +51,10 @@ static class func_lut_t {
     typedef dictionary<pstring, ParserFun>::t dic_t;
     dic_t dict;
 public:
+    typedef dic_t::const_iterator const_iterator;
     func_lut_t();
-    ParserFun get(pstring what) const {
-	dic_t::const_iterator it = dict.find(what);
-	if (it == dict.end()) return 0;
-	return it->second;
-    }
+    const_iterator begin() const { return dict.begin(); }
+    const_iterator end() const { return dict.end(); }
 } func_lut;
 func_lut_t::func_lut_t() {
     dict["add"]             = &ScriptParser::addCommand;
@@ -175,6 +173,7 @@ ScriptParser::ScriptParser()
     is_bundled = false;
 #endif
     nsa_offset = 0;
+    archive_index_cache_flag = false;
     key_table = NULL;
     force_button_shortcut_flag = false;
 
@@ -197,6 +196,10 @@ ScriptParser::ScriptParser()
     syscall_dict["rmenu"]       = SYSTEM_MENU;
     syscall_dict["automode"]    = SYSTEM_AUTOMODE;
     syscall_dict["end"]         = SYSTEM_END;
+
+    for (func_lut_t::const_iterator i = func_lut.begin();
+         i != func_lut.end(); ++i)
+        registerCommand(i->first, i->second);
 }
 
 
@@ -210,7 +213,9 @@ ScriptParser::~ScriptParser()
 
 void ScriptParser::reset()
 {
-    user_func_lut.clear();
+    for (std::deque<Command>::iterator i = commands.begin();
+         i != commands.end(); ++i)
+        i->user = false;
 
     // reset misc variables
     nsa_path.trunc(0);
@@ -454,7 +459,7 @@ rgb_t ScriptParser::readColour(const char* buf)
 
 int ScriptParser::parseLine()
 {
-    pstring cmd = script_h.getStrBuf();
+    const pstring& cmd = script_h.getStrBuf();
     if (debug_level > 1) {
         LOG_F(INFO, "ScriptParser::Parseline %s", (const char*) cmd);
         fflush(stdout);
@@ -465,30 +470,50 @@ int ScriptParser::parseLine()
     if (cmd[0] == ';' || cmd[0] == '*' || cmd[0] == ':' || cmd[0] == 0x0a)
 	return RET_CONTINUE;
 
-    bool is_orig_cmd = false;
-    if (cmd[0] != '_') {
-	if (user_func_lut.find(cmd) != user_func_lut.end()) {
-	    gosubReal(cmd, script_h.getNext());
-	    return RET_CONTINUE;
-	}
+    bool is_orig_cmd = cmd[0] == '_';
+    int id = script_h.getCommandId();
+    if (id < 0) {
+        id = commandId(is_orig_cmd ? cmd.midstr(1, cmd.length()) : cmd);
+        script_h.setCommandId(id);
     }
-    else {
-	cmd.remove(0, 1);
-	is_orig_cmd = true;
+
+    const Command& command = commands[id];
+    if (command.user && !is_orig_cmd) {
+        gosubReal(command.name, script_h.getNext());
+        return RET_CONTINUE;
     }
-    ParserFun f = func_lut.get(cmd);
-    if (f) {
+    if (command.builtin) {
         if (is_orig_cmd && (debug_level > 0)) {
             LOG_F(INFO, "** executing builtin command '%s' **",
-                   (const char*) cmd);
+                   (const char*) command.name);
             fflush(stdout);
         }
-        return (this->*f)(cmd);
+        return (this->*command.builtin)(command.name);
     } else
         return RET_NOMATCH;
 }
 
 
+int ScriptParser::commandId(const pstring& name)
+{
+    dictionary<pstring, int>::t::iterator i = command_ids.find(name);
+    if (i != command_ids.end()) return i->second;
+
+    Command command;
+    command.name = name;
+    command.builtin = NULL;
+    command.user = false;
+    commands.push_back(command);
+    return command_ids[name] = commands.size() - 1;
+}
+
+
+void ScriptParser::registerCommand(const pstring& name, CommandFun f)
+{
+    commands[commandId(name)].builtin = f;
+}
+
+
 int ScriptParser::getSystemCallNo(const pstring& buffer)
 {
     syscall_dict_t::iterator e = syscall_dict.find(buffer);
@@ -706,7 +731,7 @@ void ScriptParser::writeArrayVariable(bool output_flag)
 {
     ScriptHandler::ArrayVariable::iterator it = script_h.arrays.begin();
     while (it != script_h.arrays.end()) {
-        for (h_index_t::iterator d = it->second.begin();
+        for (std::vector<int>::iterator d = it->second.begin();
 	     d != it->second.end(); ++d) {
             unsigned long ch = *d;
             if (output_flag) {
@@ -727,7 +752,7 @@ void ScriptParser::readArrayVariable()
 {
     ScriptHandler::ArrayVariable::iterator it = script_h.arrays.begin();
     while (it != script_h.arrays.end()) {
-        for (h_index_t::iterator d = it->second.begin();
+        for (std::vector<int>::iterator d = it->second.begin();
 	     d != it->second.end(); ++d) {
             unsigned long ret;
             if (file_io_buf_ptr + 3 >= file_io_buf_len) return;
@@ -33,6 +33,7 @@
 #include "DirectReader.h"
 #include "AnimationInfo.h"
 #include "Fontinfo.h"
+#include <deque>
 
 #if defined(USE_OGG_VORBIS)
 #if defined(INTEGER_OGG_VORBIS)
@@ -62,11 +63,9 @@ struct OVInfo{
     int cvt_len;
     int mult1;
     int mult2;
-    unsigned char *buf;
+    SDL_RWops* src;
     long decoded_length;
 #if defined(USE_OGG_VORBIS)
-    ogg_int64_t length;
-    ogg_int64_t pos;
     int loop;
     ogg_int64_t loop_start;
     ogg_int64_t loop_end;
@@ -98,6 +97,8 @@ public:
     void setArchivePath(const pstring& path);
     void setSavePath(const pstring& path);
     void setNsaOffset(const char *off);
+    void enableArchiveIndexCache() { archive_index_cache_flag = true; }
+    void enableScriptCache() { script_h.enableScriptSnapshot(); }
 
 #ifdef MACOSX
     void checkBundled();
@@ -198,7 +199,23 @@ public:
     int addCommand(const pstring& cmd);
 
 protected:
-    set<pstring>::t user_func_lut;
+    // Called when nsa or arc is about to delete ScriptHandler::cBR to
+    // replace it, while anything that still points into it can be let go.
+    virtual void archiveReaderClosing() {}
+
+    // Builtins and defsub names share one table; parseLine finds a
+    // command by the number ScriptHandler caches with its token, so the
+    // name is only looked up the first time each call site is read.
+    typedef int (ScriptParser::*CommandFun)(const pstring&);
+    struct Command {
+        pstring name;
+        CommandFun builtin; // NULL if there is none
+        bool user;          // defined with defsub
+    };
+    std::deque<Command> commands;
+    dictionary<pstring, int>::t command_ids;
+    int commandId(const pstring& name);
+    void registerCommand(const pstring& name, CommandFun f);
 
     struct NestInfo {
     typedef std::vector<NestInfo> vector;
@@ -262,6 +279,7 @@ protected:
     pstring nsa_path;
 
     int nsa_offset;
+    bool archive_index_cache_flag;
     bool globalon_flag;
     bool labellog_flag;
     bool filelog_flag;
@@ -424,8 +424,11 @@ int ScriptParser::nsaCommand(const pstring& cmd)
         archive_type = NsaReader::ARCHIVE_TYPE_NS3;
     }
 
+    archiveReaderClosing();
     delete ScriptHandler::cBR;
-    ScriptHandler::cBR = new NsaReader(&archive_path, key_table);
+    NsaReader* reader = new NsaReader(&archive_path, key_table);
+    if (archive_index_cache_flag) reader->setIndexCacheDir(script_h.save_path);
+    ScriptHandler::cBR = reader;
     if (ScriptHandler::cBR->open(nsa_path, archive_type))
         LOG_F(INFO, " *** failed to open Nsa archive, ignored.  ***");
 
@@ -1084,7 +1087,7 @@ int ScriptParser::defvoicevolCommand(const pstring& cmd)
 
 int ScriptParser::defsubCommand(const pstring& cmd)
 {
-    user_func_lut.insert(script_h.readBareword());
+    commands[commandId(script_h.readBareword())].user = true;
     return RET_CONTINUE;
 }
 
@@ -1214,8 +1217,12 @@ int ScriptParser::arcCommand(const pstring& cmd)
     if (buf.find('|', 0) > 0)
         buf.trunc(buf.find('|', 0)); // TODO: check this removes the |
     if (ScriptHandler::cBR->getArchiveName() == "direct") {
+        archiveReaderClosing();
         delete ScriptHandler::cBR;
-        ScriptHandler::cBR = new SarReader(&archive_path, key_table);
+        SarReader* reader = new SarReader(&archive_path, key_table);
+        if (archive_index_cache_flag)
+            reader->setIndexCacheDir(script_h.save_path);
+        ScriptHandler::cBR = reader;
         if (ScriptHandler::cBR->open(buf))
             LOG_F(INFO, " *** failed to open archive %s, ignored.  ***",
 		    (const char*) buf);
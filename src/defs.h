@@ -28,6 +28,7 @@
 #include <deque>
 #include <map>
 #include <set>
+#include <unordered_map>
 
 #include "pstring.h"
 #ifdef USE_HASH
@@ -62,7 +63,57 @@ struct set {
     typedef std::set<T> t;
 #endif
 };
-typedef std::vector<int> h_index_t;
+
+// Array subscripts and dimensions, held inline so that reading an array
+// element doesn't allocate.  Arrays have at most MAX_DIMENSIONS; the
+// spare slot takes the subscript Expression::mutate may append.
+struct h_index_t {
+    enum { MAX_DIMENSIONS = 15 };
+    typedef int size_type;
+    typedef int* iterator;
+    typedef const int* const_iterator;
+
+    h_index_t() : n(0) {}
+
+    size_type size() const { return n; }
+    void push_back(int i) {
+        if (n > MAX_DIMENSIONS) overflow();
+        v[n++] = i;
+    }
+    int& back() { return v[n - 1]; }
+    int& operator[](size_type i) { return v[i]; }
+    int operator[](size_type i) const { return v[i]; }
+
+    iterator begin() { return v; }
+    iterator end() { return v + n; }
+    const_iterator begin() const { return v; }
+    const_iterator end() const { return v + n; }
+
+private:
+    size_type n;
+    int v[MAX_DIMENSIONS + 1];
+
+    // parseArray keeps scripts within the limit, so this is a bug.
+    static void overflow() {
+        fprintf(stderr, "h_index_t: more than %d subscripts\n",
+                MAX_DIMENSIONS + 1);
+        abort();
+    }
+};
+
+// Hash functor for keying std::unordered_map on pstring (FNV-1a over
+// the raw bytes).
+struct pstring_hash {
+    size_t operator()(const pstring& s) const {
+        const unsigned char* c = s;
+        size_t h = 2166136261u;
+        for (int i = 0; i < s.length(); ++i) {
+            h ^= c[i];
+            h *= 16777619u;
+        }
+        return h;
+    }
+};
 
 struct __attribute__((__packed__))
 rgb_t {
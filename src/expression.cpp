@@ -259,13 +259,12 @@ Expression ScriptHandler::readExpr()
 	? readStrExpr()
 	: readIntExpr();
     if (e.type() == Expression::Bareword) {
-	numalias_t::iterator a = num_aliases.find(e.as_string());
-	if (a != num_aliases.end()) {
-	    return Expression(*this, Expression::Int, 0, a->second);
+	const Alias* a = findAlias(e.as_string());
+	if (a && a->num_flag) {
+	    return Expression(*this, Expression::Int, 0, a->num);
 	}
-	stralias_t::iterator b = str_aliases.find(e.as_string());
-	if (b != str_aliases.end()) {
-	    return Expression(*this, Expression::String, 0, a->second);
+	if (a && a->str_flag) {
+	    return Expression(*this, Expression::String, 0, a->str);
 	}
     }
     return e;
@@ -26,11 +26,13 @@
 #include "graphics_common.h"
 
 #include "graphics_altivec.h"
+#include "graphics_avx2.h"
 #include "graphics_mmx.h"
 #include "graphics_sse2.h"
 #include "graphics_ssse3.h"
 
 #include <stdio.h>
+#include <loguru.hpp>
 
 #ifdef USE_X86_GFX
 # if defined(__SSSE3__)
@@ -67,13 +69,13 @@ void imageFilterMean_Basic(unsigned char *src1, unsigned char *src2, unsigned ch
     }
 }
 
-void imageFilterAddTo_Basic(unsigned char *src, unsigned char *dst, int length) {
+void imageFilterAddTo_Basic(unsigned char *dst, unsigned char *src, int length) {
     for (int i = 0; i < length; i++) {
         addto_pixel(dst[i], src[i]);
     }
 }
 
-void imageFilterSubFrom_Basic(unsigned char *src, unsigned char *dst, int length) {
+void imageFilterSubFrom_Basic(unsigned char *dst, unsigned char *src, int length) {
     for (int i = 0; i < length; i++) {
         subfrom_pixel(dst[i], src[i]);
     }
@@ -86,6 +88,24 @@ void imageFilterBlend_Basic(Uint32 *dst_buffer, Uint32 *src_buffer,
     BASIC_BLEND();
 }
 
+void imageFilterAddBlend_Basic(Uint32 *dst_buffer, Uint32 *src_buffer,
+                               Uint8 *alphap, int alpha, int length)
+{
+#ifndef BPP16 // only 32-bit surfaces have additive and subtractive blending
+    int n = length + 1;
+    BASIC_ADDBLEND();
+#endif
+}
+
+void imageFilterSubBlend_Basic(Uint32 *dst_buffer, Uint32 *src_buffer,
+                               Uint8 *alphap, int alpha, int length)
+{
+#ifndef BPP16 // only 32-bit surfaces have additive and subtractive blending
+    int n = length + 1;
+    BASIC_SUBBLEND();
+#endif
+}
+
 bool alphaMaskBlend_Basic(SDL_Surface* dst, SDL_Surface *s1, SDL_Surface *s2, SDL_Surface *mask_surface, const SDL_Rect& rect, Uint32 mask_value) {
     return false;
 }
@@ -132,6 +152,17 @@ static bool hasFastPSHUFB(Manufacturer mf, int eax, int ecx) {
     }
     return true;
 }
+
+static bool hasAVX2(int ecx) {
+    // The OS has to save the upper halves of the ymm registers too
+    if (!(ecx & bit_OSXSAVE) || !(ecx & bit_AVX)) { return false; }
+    unsigned int xcr0_lo, xcr0_hi;
+    asm volatile("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    if ((xcr0_lo & 0x6) != 0x6) { return false; }
+    unsigned int eax, ebx, ecx7, edx;
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx7, &edx) == 0) { return false; }
+    return ebx & bit_AVX2;
+}
 #endif
 
 AcceleratedGraphicsFunctions AcceleratedGraphicsFunctions::accelerated() {
@@ -165,15 +196,30 @@ AcceleratedGraphicsFunctions AcceleratedGraphicsFunctions::accelerated() {
             out._imageFilterAddTo = imageFilterAddTo_SSE2;
             out._imageFilterSubFrom = imageFilterSubFrom_SSE2;
             out._imageFilterBlend = imageFilterBlend_SSE2;
+            out._imageFilterAddBlend = imageFilterAddBlend_SSE2;
+            out._imageFilterSubBlend = imageFilterSubBlend_SSE2;
             out._alphaMaskBlend = alphaMaskBlend_SSE2;
             out._alphaMaskBlendConst = alphaMaskBlendConst_SSE2;
         }
         if (_M_SSE >= 0x301 || hasFastPSHUFB(mf, eax, ecx)) {
             LOG_F(INFO, "SSSE3 ");
             out._imageFilterBlend = imageFilterBlend_SSSE3;
+            out._imageFilterAddBlend = imageFilterAddBlend_SSSE3;
+            out._imageFilterSubBlend = imageFilterSubBlend_SSSE3;
             out._alphaMaskBlend = alphaMaskBlend_SSSE3;
             out._alphaMaskBlendConst = alphaMaskBlendConst_SSSE3;
         }
+        if (hasAVX2(ecx)) {
+            LOG_F(INFO, "AVX2 ");
+            out._imageFilterMean = imageFilterMean_AVX2;
+            out._imageFilterAddTo = imageFilterAddTo_AVX2;
+            out._imageFilterSubFrom = imageFilterSubFrom_AVX2;
+            out._imageFilterBlend = imageFilterBlend_AVX2;
+            out._imageFilterAddBlend = imageFilterAddBlend_AVX2;
+            out._imageFilterSubBlend = imageFilterSubBlend_AVX2;
+            out._alphaMaskBlend = alphaMaskBlend_AVX2;
+            out._alphaMaskBlendConst = alphaMaskBlendConst_AVX2;
+        }
         LOG_F(INFO, "");
     }
 #elif defined(USE_PPC_GFX)
@@ -30,6 +30,8 @@ void imageFilterMean_Basic(unsigned char *src1, unsigned char *src2, unsigned ch
 void imageFilterAddTo_Basic(unsigned char *dst, unsigned char *src, int length);
 void imageFilterSubFrom_Basic(unsigned char *dst, unsigned char *src, int length);
 void imageFilterBlend_Basic(Uint32 *dst_buffer, Uint32 *src_buffer, Uint8 *alphap, int alpha, int length);
+void imageFilterAddBlend_Basic(Uint32 *dst_buffer, Uint32 *src_buffer, Uint8 *alphap, int alpha, int length);
+void imageFilterSubBlend_Basic(Uint32 *dst_buffer, Uint32 *src_buffer, Uint8 *alphap, int alpha, int length);
 bool alphaMaskBlend_Basic(SDL_Surface* dst, SDL_Surface *s1, SDL_Surface *s2, SDL_Surface *mask_surface, const SDL_Rect& rect, Uint32 mask_value);
 void alphaMaskBlendConst_Basic(SDL_Surface* dst, SDL_Surface *s1, SDL_Surface *s2, const SDL_Rect& rect, Uint32 mask_value);
 
@@ -38,6 +40,8 @@ class AcceleratedGraphicsFunctions {
     void (*_imageFilterAddTo)(unsigned char *dst, unsigned char *src, int length);
     void (*_imageFilterSubFrom)(unsigned char *dst, unsigned char *src, int length);
     void (*_imageFilterBlend)(Uint32 *dst_buffer, Uint32 *src_buffer, Uint8 *alphap, int alpha, int length);
+    void (*_imageFilterAddBlend)(Uint32 *dst_buffer, Uint32 *src_buffer, Uint8 *alphap, int alpha, int length);
+    void (*_imageFilterSubBlend)(Uint32 *dst_buffer, Uint32 *src_buffer, Uint8 *alphap, int alpha, int length);
     bool (*_alphaMaskBlend)(SDL_Surface* dst, SDL_Surface *s1, SDL_Surface *s2, SDL_Surface *mask_surface, const SDL_Rect& rect, Uint32 mask_value);
     void (*_alphaMaskBlendConst)(SDL_Surface* dst, SDL_Surface *s1, SDL_Surface *s2, const SDL_Rect& rect, Uint32 mask_value);
 
@@ -47,6 +51,8 @@ public:
         _imageFilterAddTo = imageFilterAddTo_Basic;
         _imageFilterSubFrom = imageFilterSubFrom_Basic;
         _imageFilterBlend = imageFilterBlend_Basic;
+        _imageFilterAddBlend = imageFilterAddBlend_Basic;
+        _imageFilterSubBlend = imageFilterSubBlend_Basic;
         _alphaMaskBlend = alphaMaskBlend_Basic;
         _alphaMaskBlendConst = alphaMaskBlendConst_Basic;
     }
@@ -69,6 +75,14 @@ public:
         _imageFilterBlend(dst_buffer, src_buffer, alphap, alpha, length);
     }
 
+    void imageFilterAddBlend(Uint32 *dst_buffer, Uint32 *src_buffer, Uint8 *alphap, int alpha, int length) {
+        _imageFilterAddBlend(dst_buffer, src_buffer, alphap, alpha, length);
+    }
+
+    void imageFilterSubBlend(Uint32 *dst_buffer, Uint32 *src_buffer, Uint8 *alphap, int alpha, int length) {
+        _imageFilterSubBlend(dst_buffer, src_buffer, alphap, alpha, length);
+    }
+
     bool alphaMaskBlend(SDL_Surface* dst, SDL_Surface *s1, SDL_Surface *s2, SDL_Surface *mask_surface, const SDL_Rect& rect, Uint32 mask_value) {
         return _alphaMaskBlend(dst, s1, s2, mask_surface, rect, mask_value);
     }
@@ -0,0 +1,336 @@
+/* -*- C++ -*-
+ *
+ *  graphics_avx2.cpp - graphics routines using X86 AVX2 cpu functionality
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>
+ *  or write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+// 256-bit versions of the SSE2/SSSE3 routines.  These give exactly the
+// results of the _Basic functions (the SSE2 mean does not), so switching
+// between them never changes what's on screen.
+
+#ifdef USE_X86_GFX
+
+#include "graphics_avx2.h"
+#include "graphics_x86_common.h"
+
+/// 0x0000gg?? -> 0x00gg00gg
+static HELPER_FN __m256i extractFromGTo16L(__m256i v) {
+    __m256i mask = _mm256_setr_epi8(1, 0x80, 1, 0x80, 5, 0x80, 5, 0x80, 9, 0x80, 9, 0x80, 13, 0x80, 13, 0x80,
+                                    1, 0x80, 1, 0x80, 5, 0x80, 5, 0x80, 9, 0x80, 9, 0x80, 13, 0x80, 13, 0x80);
+    return _mm256_shuffle_epi8(v, mask);
+}
+
+/// 0x????gg?? -> 0x000000gg
+static HELPER_FN __m256i extractG(__m256i v) {
+    __m256i mask = _mm256_setr_epi8(1, 0x80, 0x80, 0x80, 5, 0x80, 0x80, 0x80, 9, 0x80, 0x80, 0x80, 13, 0x80, 0x80, 0x80,
+                                    1, 0x80, 0x80, 0x80, 5, 0x80, 0x80, 0x80, 9, 0x80, 0x80, 0x80, 13, 0x80, 0x80, 0x80);
+    return _mm256_shuffle_epi8(v, mask);
+}
+
+/// 0x000000bb -> 0x00bb00bb
+static HELPER_FN __m256i extractBTo16L(__m256i v) {
+    __m256i mask = _mm256_setr_epi8(0, 0x80, 0, 0x80, 4, 0x80, 4, 0x80, 8, 0x80, 8, 0x80, 12, 0x80, 12, 0x80,
+                                    0, 0x80, 0, 0x80, 4, 0x80, 4, 0x80, 8, 0x80, 8, 0x80, 12, 0x80, 12, 0x80);
+    return _mm256_shuffle_epi8(v, mask);
+}
+
+/// ((s1 & rbmask) * mask1 + (s2 & rbmask) * mask2) >> 8 per channel,
+/// with mask1 and mask2 spread as 0x00mm00mm
+static HELPER_FN __m256i blendChannels(__m256i s1v, __m256i s2v, __m256i mask1, __m256i mask2) {
+    __m256i mask_00ff00ff = _mm256_set1_epi32(0x00FF00FF);
+    __m256i s1v_rb = _mm256_mullo_epi16(mask1, _mm256_and_si256(s1v, mask_00ff00ff));
+    __m256i s2v_rb = _mm256_mullo_epi16(mask2, _mm256_and_si256(s2v, mask_00ff00ff));
+    __m256i out_rb = _mm256_srli_epi16(_mm256_add_epi16(s1v_rb, s2v_rb), 8);
+    __m256i s1v_g = _mm256_mullo_epi16(mask1, extractG(s1v));
+    __m256i s2v_g = _mm256_mullo_epi16(mask2, extractG(s2v));
+    __m256i out_g = _mm256_andnot_si256(mask_00ff00ff, _mm256_add_epi16(s1v_g, s2v_g));
+    return _mm256_or_si256(out_rb, out_g);
+}
+
+/// Scales each color channel of src by its own alpha times alpha (as
+/// ADDBLEND_PIXEL and SUBBLEND_PIXEL do), leaving the alpha byte 0
+static HELPER_FN __m256i scaleBySrcAlpha(__m256i src, __m256i alpha) {
+    __m256i bmask2 = _mm256_set1_epi32(0x00FF00FF);
+    __m256i a = extractFromGTo16L(_mm256_mullo_epi16(alpha, _mm256_srli_epi32(src, 24)));
+    __m256i rb = _mm256_srli_epi16(_mm256_mullo_epi16(a, _mm256_and_si256(src, bmask2)), 8);
+    __m256i g = _mm256_andnot_si256(bmask2, _mm256_mullo_epi16(a, extractG(src)));
+    return _mm256_or_si256(rb, g);
+}
+
+
+void imageFilterMean_AVX2(unsigned char *src1, unsigned char *src2, unsigned char *dst, int length)
+{
+    int i = 0;
+
+    // Compute first few values so we're on a 32-byte boundary in dst
+    for (; !is_aligned(dst + i, 32) && (i < length); i++) {
+        dst[i] = mean_pixel(src1[i], src2[i]);
+    }
+
+    // pavgb rounds up, so take back the carry from odd sums:
+    // (a + b) / 2 == avg(a, b) - ((a ^ b) & 1)
+    __m256i one = _mm256_set1_epi8(1);
+    for (; i < length - 31; i += 32) {
+        __m256i s1 = _mm256_loadu_si256((__m256i*)(src1 + i));
+        __m256i s2 = _mm256_loadu_si256((__m256i*)(src2 + i));
+        __m256i odd = _mm256_and_si256(_mm256_xor_si256(s1, s2), one);
+        __m256i r = _mm256_sub_epi8(_mm256_avg_epu8(s1, s2), odd);
+        _mm256_store_si256((__m256i*)(dst + i), r);
+    }
+
+    // If any bytes are left over, deal with them individually
+    for (; i < length; i++) {
+        dst[i] = mean_pixel(src1[i], src2[i]);
+    }
+}
+
+
+void imageFilterAddTo_AVX2(unsigned char *dst, unsigned char *src, int length)
+{
+    int i = 0;
+
+    // Compute first few values so we're on a 32-byte boundary in dst
+    for (; !is_aligned(dst + i, 32) && (i < length); i++) {
+        addto_pixel(dst[i], src[i]);
+    }
+
+    // Do bulk of processing using AVX2 (add 32 8-bit unsigned integers, with saturation)
+    for (; i < length - 31; i += 32) {
+        __m256i s = _mm256_loadu_si256((__m256i*)(src + i));
+        __m256i d = _mm256_load_si256((__m256i*)(dst + i));
+        _mm256_store_si256((__m256i*)(dst + i), _mm256_adds_epu8(s, d));
+    }
+
+    // If any bytes are left over, deal with them individually
+    for (; i < length; i++) {
+        addto_pixel(dst[i], src[i]);
+    }
+}
+
+
+void imageFilterSubFrom_AVX2(unsigned char *dst, unsigned char *src, int length)
+{
+    int i = 0;
+
+    // Compute first few values so we're on a 32-byte boundary in dst
+    for (; !is_aligned(dst + i, 32) && (i < length); i++) {
+        subfrom_pixel(dst[i], src[i]);
+    }
+
+    // Do bulk of processing using AVX2 (sub 32 8-bit unsigned integers, with saturation)
+    for (; i < length - 31; i += 32) {
+        __m256i s = _mm256_loadu_si256((__m256i*)(src + i));
+        __m256i d = _mm256_load_si256((__m256i*)(dst + i));
+        _mm256_store_si256((__m256i*)(dst + i), _mm256_subs_epu8(d, s));
+    }
+
+    // If any bytes are left over, deal with them individually
+    for (; i < length; i++) {
+        subfrom_pixel(dst[i], src[i]);
+    }
+}
+
+
+void imageFilterBlend_AVX2(Uint32 *dst_buffer, Uint32 *src_buffer, Uint8 *alphap, int alpha, int length)
+{
+    int n = length;
+
+    // Compute first few values so we're on a 32-byte boundary in dst_buffer
+    while (!is_aligned(dst_buffer, 32) && (n > 0)) {
+        BLEND_PIXEL();
+        --n; ++dst_buffer; ++src_buffer;
+    }
+
+    // Process 8 pixels at a time.  BLEND_PIXEL leaves transparent pixels
+    // alone and copies opaque ones outright when alpha is 256, so do the
+    // same rather than taking the blended value for those.
+    __m256i bmask2 = _mm256_set1_epi32(0x00FF00FF);
+    __m256i alpha_v = _mm256_set1_epi32(alpha);
+    __m256i zero = _mm256_setzero_si256();
+    __m256i opaque = _mm256_set1_epi32(alpha == 256 ? 0xFF : -1);
+    while (n >= 8) {
+        __m256i s = _mm256_loadu_si256((__m256i*)src_buffer);
+        __m256i d = _mm256_load_si256((__m256i*)dst_buffer);
+        __m256i src_a = _mm256_srli_epi32(s, 24);
+        // alpha2 = (src_a * alpha) >> 8, spread as 0x00vv00vv
+        __m256i a2 = extractFromGTo16L(_mm256_mullo_epi16(alpha_v, src_a));
+        __m256i a1 = _mm256_xor_si256(a2, bmask2);
+        __m256i r = blendChannels(d, s, a1, a2);
+        r = _mm256_blendv_epi8(r, d, _mm256_cmpeq_epi32(src_a, zero));
+        r = _mm256_blendv_epi8(r, s, _mm256_cmpeq_epi32(src_a, opaque));
+        _mm256_store_si256((__m256i*)dst_buffer, r);
+
+        n -= 8; src_buffer += 8; dst_buffer += 8; alphap += 32;
+    }
+
+    // If any pixels are left over, deal with them individually
+    ++n;
+    BASIC_BLEND();
+}
+
+
+void imageFilterAddBlend_AVX2(Uint32 *dst_buffer, Uint32 *src_buffer, Uint8 *alphap, int alpha, int length)
+{
+    int n = length;
+
+    // Compute first few values so we're on a 32-byte boundary in dst_buffer
+    while (!is_aligned(dst_buffer, 32) && (n > 0)) {
+        ADDBLEND_PIXEL();
+        --n; ++dst_buffer; ++src_buffer;
+    }
+
+    // Add the scaled channels with saturation, 8 pixels at a time
+    __m256i alpha_v = _mm256_set1_epi32(alpha);
+    __m256i rgbmask = _mm256_set1_epi32(RGBMASK);
+    while (n >= 8) {
+        __m256i s = scaleBySrcAlpha(_mm256_loadu_si256((__m256i*)src_buffer), alpha_v);
+        __m256i d = _mm256_load_si256((__m256i*)dst_buffer);
+        _mm256_store_si256((__m256i*)dst_buffer, _mm256_and_si256(_mm256_adds_epu8(d, s), rgbmask));
+
+        n -= 8; src_buffer += 8; dst_buffer += 8; alphap += 32;
+    }
+
+    // If any pixels are left over, deal with them individually
+    ++n;
+    BASIC_ADDBLEND();
+}
+
+
+void imageFilterSubBlend_AVX2(Uint32 *dst_buffer, Uint32 *src_buffer, Uint8 *alphap, int alpha, int length)
+{
+    int n = length;
+
+    // Compute first few values so we're on a 32-byte boundary in dst_buffer
+    while (!is_aligned(dst_buffer, 32) && (n > 0)) {
+        SUBBLEND_PIXEL();
+        --n; ++dst_buffer; ++src_buffer;
+    }
+
+    // Subtract the scaled channels with saturation, 8 pixels at a time
+    __m256i alpha_v = _mm256_set1_epi32(alpha);
+    __m256i rgbmask = _mm256_set1_epi32(RGBMASK);
+    while (n >= 8) {
+        __m256i s = scaleBySrcAlpha(_mm256_loadu_si256((__m256i*)src_buffer), alpha_v);
+        __m256i d = _mm256_load_si256((__m256i*)dst_buffer);
+        _mm256_store_si256((__m256i*)dst_buffer, _mm256_and_si256(_mm256_subs_epu8(d, s), rgbmask));
+
+        n -= 8; src_buffer += 8; dst_buffer += 8; alphap += 32;
+    }
+
+    // If any pixels are left over, deal with them individually
+    ++n;
+    BASIC_SUBBLEND();
+}
+
+
+bool alphaMaskBlend_AVX2(SDL_Surface* dst, SDL_Surface *s1, SDL_Surface *s2, SDL_Surface *mask_surface, const SDL_Rect& rect, Uint32 mask_value)
+{
+    // The wraparound below assumes a whole vector never spans the mask twice
+    if (mask_surface->w < 8) {
+        return alphaMaskBlend_SSE_Common(dst, s1, s2, mask_surface, rect, mask_value);
+    }
+
+    int end_x = rect.x + rect.w;
+    int end_y = rect.y + rect.h;
+    int mask_height = mask_surface->h;
+    int mask_width = mask_surface->w;
+
+    int mask_off_base_y = rect.y % mask_surface->h;
+    int mask_off_base_x = rect.x % mask_surface->w;
+    __m256i mask_value_v = _mm256_set1_epi32(mask_value);
+    __m256i mask_000000ff = _mm256_set1_epi32(0x000000FF);
+    __m256i mask_00ff00ff = _mm256_set1_epi32(0x00FF00FF);
+    for (int y = rect.y, my = mask_off_base_y; y < end_y; y++, my++) {
+        if (my >= mask_height) { my = 0; }
+        Uint32* s1p = getPointerToRow<Uint32>(s1, y);
+        Uint32* s2p = getPointerToRow<Uint32>(s2, y);
+        Uint32* dstp = getPointerToRow<Uint32>(dst, y);
+        Uint32* mask_buf = getPointerToRow<Uint32>(mask_surface, my);
+
+        int x = rect.x, mx = mask_off_base_x;
+        while (!is_aligned(dstp + x, 32) && (x < end_x)) {
+            dstp[x] = blendMaskOnePixel(s1p[x], s2p[x], mask_buf[mx], mask_value);
+            x++, mx++;
+            if (mx >= mask_width) { mx = 0; }
+        }
+        while (x < (end_x - 7)) {
+            __m256i s1v = _mm256_loadu_si256((__m256i*)(s1p + x));
+            __m256i s2v = _mm256_loadu_si256((__m256i*)(s2p + x));
+            __m256i mskv;
+            if (__builtin_expect(mx + 7 < mask_width, true)) {
+                mskv = _mm256_loadu_si256((__m256i*)(mask_buf + mx));
+            } else {
+                __attribute__((aligned(32))) Uint32 tmp[8];
+                for (int i = 0; i < 8; i++) {
+                    if (mx + i < mask_width) {
+                        tmp[i] = mask_buf[mx + i];
+                    } else {
+                        tmp[i] = mask_buf[mx + i - mask_width];
+                    }
+                }
+                mskv = _mm256_load_si256((__m256i*)tmp);
+            }
+            mskv = _mm256_and_si256(mskv, mask_000000ff);
+            __m256i mask2 = _mm256_subs_epu16(mask_value_v, mskv);
+            mask2 = _mm256_min_epi16(mask2, mask_000000ff); // min(mask2, 0xFF)
+            mask2 = extractBTo16L(mask2); // Spread alpha for multiplying (0x00aa00aa)
+            __m256i mask1 = _mm256_xor_si256(mask2, mask_00ff00ff);
+            _mm256_store_si256((__m256i*)(dstp + x), blendChannels(s1v, s2v, mask1, mask2));
+
+            x += 8;
+            mx += 8;
+            if (mx >= mask_width) { mx -= mask_width; }
+        }
+        while (x < end_x) {
+            dstp[x] = blendMaskOnePixel(s1p[x], s2p[x], mask_buf[mx], mask_value);
+            x++, mx++;
+            if (mx >= mask_width) { mx = 0; }
+        }
+    }
+    return true;
+}
+
+
+void alphaMaskBlendConst_AVX2(SDL_Surface* dst, SDL_Surface *s1, SDL_Surface *s2, const SDL_Rect& rect, Uint32 mask_value)
+{
+    int end_x = rect.x + rect.w;
+    int end_y = rect.y + rect.h;
+    // blendMaskOnePixel caps the mask at 0xFF
+    __m256i mask_00ff00ff = _mm256_set1_epi32(0x00FF00FF);
+    __m256i mask2 = _mm256_set1_epi16(mask_value < 0xFF ? mask_value : 0xFF);
+    __m256i mask1 = _mm256_xor_si256(mask2, mask_00ff00ff);
+    for (int y = rect.y; y < end_y; y++) {
+        Uint32* s1p = getPointerToRow<Uint32>(s1, y);
+        Uint32* s2p = getPointerToRow<Uint32>(s2, y);
+        Uint32* dstp = getPointerToRow<Uint32>(dst, y);
+
+        int x = rect.x;
+        for (; !is_aligned(dstp + x, 32) && (x < end_x); x++) {
+            dstp[x] = blendMaskOnePixel(s1p[x], s2p[x], 0, mask_value);
+        }
+        for (; x < (end_x - 7); x += 8) {
+            __m256i s1v = _mm256_loadu_si256((__m256i*)(s1p + x));
+            __m256i s2v = _mm256_loadu_si256((__m256i*)(s2p + x));
+            _mm256_store_si256((__m256i*)(dstp + x), blendChannels(s1v, s2v, mask1, mask2));
+        }
+        for (; x < end_x; x++) {
+            dstp[x] = blendMaskOnePixel(s1p[x], s2p[x], 0, mask_value);
+        }
+    }
+}
+
+#endif
@@ -90,6 +90,35 @@ static HELPER_FN Px *getPointerToRow(SDL_Surface *surface, int y) {
     return reinterpret_cast<Px*>(buf);
 }
 
+// Steps n * x / d (C's truncating division, d > 0) through successive x
+// without dividing at each step. The quotient is kept floored, with the
+// remainder r in [0, d), and the truncated one is q + (q < 0 && r != 0).
+struct TruncDivStepper {
+    int q, r, step_q, step_r, d;
+
+    TruncDivStepper(int n, int x, int d) : d(d) {
+        step_q = floorDiv(n, d);
+        step_r = n - step_q * d;
+        q = floorDiv(n * x, d);
+        r = n * x - q * d;
+    }
+
+    int value() const { return q + (q < 0 && r != 0); }
+
+    void next() {
+        r += step_r;
+        int carry = r >= d;
+        q += step_q + carry;
+        r -= d & -carry;
+    }
+
+    // Floor division by a positive d, which C's / only gives for n >= 0.
+    static int floorDiv(int n, int d) {
+        int q = n / d;
+        return (n % d < 0) ? q - 1 : q;
+    }
+};
+
 static Uint32 blendMaskOnePixel(Uint32 s1, Uint32 s2, Uint32 msk, Uint32 mask_value) {
     Uint32 mask2 = 0;
     msk &= 0xFF;
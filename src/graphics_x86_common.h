@@ -73,23 +73,27 @@ static HELPER_FN void imageFilterBlend_SSE_Common(Uint32 *dst_buffer, Uint32 *sr
     // Do bulk of processing using SSE2 (process 4 32bit (BGRA) pixels)
     // create basic bitmasks 0x00FF00FF, 0x000000FF
     __m128i bmask2 = _mm_set1_epi32(0x00FF00FF);
+    // BLEND_PIXEL leaves transparent pixels alone and copies opaque ones
+    // outright when alpha is 256; these pick those pixels out
+    __m128i zero = _mm_setzero_si128();
+    __m128i opaque = _mm_set1_epi32(alpha == 256 ? 0xFF : -1);
     while (n >= 4) {
         // alpha1 = ((src_argb >> 24) * alpha) >> 8
         __m128i a = _mm_set1_epi32(alpha);
-        __m128i buf = _mm_loadu_si128((__m128i*)src_buffer);
-        __m128i tmp = _mm_srli_epi32(buf, 24);
-        a = _mm_mullo_epi16(a, tmp);
+        __m128i src = _mm_loadu_si128((__m128i*)src_buffer);
+        __m128i src_a = _mm_srli_epi32(src, 24);
+        a = _mm_mullo_epi16(a, src_a);
         // double-up alpha1 (0x0000vvxx -> 0x00vv00vv)
         a = extractFromGTo16L(a);
         // rb = (src_argb & bmask2) * alpha1
-        tmp = _mm_and_si128(buf, bmask2);
+        __m128i tmp = _mm_and_si128(src, bmask2);
         __m128i rb = _mm_mullo_epi16(a, tmp);
         // g = ((src_argb >> 8) & bmask) * alpha1
-        tmp = extractG(buf);
+        tmp = extractG(src);
         __m128i g = _mm_mullo_epi16(a, tmp);
         // alpha2 = alpha1 ^ bmask2
         a = _mm_xor_si128(a, bmask2);
-        buf = _mm_load_si128((__m128i*)dst_buffer);
+        __m128i buf = _mm_load_si128((__m128i*)dst_buffer);
         // rb += (dst_argb & bmask2) * alpha2
         tmp = _mm_and_si128(buf, bmask2);
         tmp = _mm_mullo_epi16(a, tmp);
@@ -104,6 +108,10 @@ static HELPER_FN void imageFilterBlend_SSE_Common(Uint32 *dst_buffer, Uint32 *sr
         g = _mm_andnot_si128(bmask2, g);
         // dst_argb = rb | g
         tmp = _mm_or_si128(rb, g);
+        __m128i keep = _mm_cmpeq_epi32(src_a, zero);
+        tmp = _mm_or_si128(_mm_and_si128(keep, buf), _mm_andnot_si128(keep, tmp));
+        __m128i copy = _mm_cmpeq_epi32(src_a, opaque);
+        tmp = _mm_or_si128(_mm_and_si128(copy, src), _mm_andnot_si128(copy, tmp));
         _mm_store_si128((__m128i*)dst_buffer, tmp);
 
         n -= 4; src_buffer += 4; dst_buffer += 4; alphap += 16;
@@ -114,6 +122,68 @@ static HELPER_FN void imageFilterBlend_SSE_Common(Uint32 *dst_buffer, Uint32 *sr
     BASIC_BLEND();
 }
 
+/// Scales each color channel of src by its own alpha times alpha (as
+/// ADDBLEND_PIXEL and SUBBLEND_PIXEL do), leaving the alpha byte 0
+static HELPER_FN __m128i scaleBySrcAlpha(__m128i src, __m128i alpha) {
+    __m128i bmask2 = _mm_set1_epi32(0x00FF00FF);
+    // mask2 = ((src_argb >> 24) * alpha) >> 8, as 0x00vv00vv
+    __m128i a = _mm_mullo_epi16(alpha, _mm_srli_epi32(src, 24));
+    a = extractFromGTo16L(a);
+    __m128i rb = _mm_srli_epi16(_mm_mullo_epi16(a, _mm_and_si128(src, bmask2)), 8);
+    __m128i g = _mm_andnot_si128(bmask2, _mm_mullo_epi16(a, extractG(src)));
+    return _mm_or_si128(rb, g);
+}
+
+static HELPER_FN void imageFilterAddBlend_SSE_Common(Uint32 *dst_buffer, Uint32 *src_buffer, Uint8 *alphap, int alpha, int length) {
+    int n = length;
+
+    // Compute first few values so we're on a 16-byte boundary in dst_buffer
+    while (!is_aligned(dst_buffer, 16) && (n > 0)) {
+        ADDBLEND_PIXEL();
+        --n; ++dst_buffer; ++src_buffer;
+    }
+
+    // Add the scaled channels with saturation, 4 pixels at a time
+    __m128i alpha_v = _mm_set1_epi32(alpha);
+    __m128i rgbmask = _mm_set1_epi32(RGBMASK);
+    while (n >= 4) {
+        __m128i s = scaleBySrcAlpha(_mm_loadu_si128((__m128i*)src_buffer), alpha_v);
+        __m128i d = _mm_load_si128((__m128i*)dst_buffer);
+        _mm_store_si128((__m128i*)dst_buffer, _mm_and_si128(_mm_adds_epu8(d, s), rgbmask));
+
+        n -= 4; src_buffer += 4; dst_buffer += 4; alphap += 16;
+    }
+
+    // If any pixels are left over, deal with them individually
+    ++n;
+    BASIC_ADDBLEND();
+}
+
+static HELPER_FN void imageFilterSubBlend_SSE_Common(Uint32 *dst_buffer, Uint32 *src_buffer, Uint8 *alphap, int alpha, int length) {
+    int n = length;
+
+    // Compute first few values so we're on a 16-byte boundary in dst_buffer
+    while (!is_aligned(dst_buffer, 16) && (n > 0)) {
+        SUBBLEND_PIXEL();
+        --n; ++dst_buffer; ++src_buffer;
+    }
+
+    // Subtract the scaled channels with saturation, 4 pixels at a time
+    __m128i alpha_v = _mm_set1_epi32(alpha);
+    __m128i rgbmask = _mm_set1_epi32(RGBMASK);
+    while (n >= 4) {
+        __m128i s = scaleBySrcAlpha(_mm_loadu_si128((__m128i*)src_buffer), alpha_v);
+        __m128i d = _mm_load_si128((__m128i*)dst_buffer);
+        _mm_store_si128((__m128i*)dst_buffer, _mm_and_si128(_mm_subs_epu8(d, s), rgbmask));
+
+        n -= 4; src_buffer += 4; dst_buffer += 4; alphap += 16;
+    }
+
+    // If any pixels are left over, deal with them individually
+    ++n;
+    BASIC_SUBBLEND();
+}
+
 static HELPER_FN bool alphaMaskBlend_SSE_Common(SDL_Surface* dst, SDL_Surface *s1, SDL_Surface *s2, SDL_Surface *mask_surface, const SDL_Rect& rect, Uint32 mask_value)
 {
     if (mask_surface->w < 4) {
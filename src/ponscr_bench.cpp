@@ -0,0 +1,262 @@
+/* -*- C++ -*-
+ *
+ *  ponscr_bench.cpp - headless script interpreter benchmark
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+// Runs scripts through ScriptParser alone, with no window or audio, and
+// reports how fast the interpreter gets through them.
+// Usage: ponscr-bench [--top n] script...
+//
+// Commands ScriptParser doesn't handle (display, sound, waits) are
+// skipped the way PonscripterLabel skips unknown commands, and text is
+// lexed but not drawn, so the figures cover tokenizing, expression
+// evaluation and control flow.  Sample scripts are in test/bench.
+
+#include "ScriptParser.h"
+#include <algorithm>
+#include <string.h>
+#include <loguru.hpp>
+
+// Allocations are counted by wrapping the C allocator, which both
+// operator new and bstrlib use.  Only glibc lets us reach the real one.
+static unsigned long allocations = 0;
+
+#ifdef __GLIBC__
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t n, size_t size);
+void* __libc_realloc(void* p, size_t size);
+
+void* malloc(size_t size)
+{
+    ++allocations;
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size)
+{
+    ++allocations;
+    return __libc_calloc(n, size);
+}
+
+void* realloc(void* p, size_t size)
+{
+    ++allocations;
+    return __libc_realloc(p, size);
+}
+}
+#define COUNTS_ALLOCATIONS 1
+#else
+#define COUNTS_ALLOCATIONS 0
+#endif
+
+
+class BenchParser : public ScriptParser {
+public:
+    struct Stat {
+        pstring name;
+        unsigned long count;
+        unsigned long allocations;
+        Uint64 ticks;
+        Stat() : count(0), allocations(0), ticks(0) {}
+        bool operator<(const Stat& o) const { return ticks > o.ticks; }
+    };
+    typedef std::map<pstring, Stat> stats_t;
+
+    BenchParser(const pstring& path);
+    int run();
+    void report(int top);
+
+private:
+    int step();
+    Stat& statFor(const pstring& token);
+
+    pstring script;
+    stats_t stats;
+    unsigned long statements;
+    Uint64 total_ticks;
+};
+
+
+BenchParser::BenchParser(const pstring& path)
+    : script(path), statements(0), total_ticks(0)
+{
+    int slash = path.reversefind(DELIMITER, path.length());
+    archive_path.add(slash >= 0 ? path.midstr(0, slash + 1) : pstring("."));
+}
+
+
+BenchParser::Stat& BenchParser::statFor(const pstring& token)
+{
+    static const pstring text = "(text)", newline = "(newline)",
+        colon = "(colon)", comment = "(comment)", label = "(label)";
+
+    const pstring* name = &token;
+    if (script_h.isText()) name = &text;
+    else if (token[0] == 0x0a) name = &newline;
+    else if (token[0] == ':') name = &colon;
+    else if (token[0] == ';') name = &comment;
+    else if (token[0] == '*') name = &label;
+
+    stats_t::iterator i = stats.find(*name);
+    if (i == stats.end()) {
+        i = stats.insert(std::make_pair(*name, Stat())).first;
+        i->second.name = *name;
+    }
+    return i->second;
+}
+
+
+// One pass of PonscripterLabel::executeLabel's loop, for what
+// ScriptParser can run by itself, short of reading the next token.
+int BenchParser::step()
+{
+    const pstring& token = script_h.getStrBuf();
+
+    if (!script_h.isText() && token[0] == '~')
+        return RET_CONTINUE;
+    if (break_flag && token != "next") {
+        if (script_h.readStrBuf(string_buffer_offset) != ':'
+            && script_h.readStrBuf(string_buffer_offset) != ';'
+            && script_h.readStrBuf(string_buffer_offset) != 0x0a)
+            script_h.skipToken();
+        return RET_CONTINUE;
+    }
+
+    const char* current = script_h.getCurrent();
+    int ret = parseLine();
+    if (ret == RET_NOMATCH) {
+        if (script_h.isText())
+            ret = RET_CONTINUE;
+        else if (token == "game") {
+            current_mode = NORMAL_MODE;
+            setCurrentLabel("start");
+            ret = RET_CONTINUE;
+        }
+        else {
+            script_h.skipToken();
+            ret = RET_CONTINUE;
+        }
+    }
+
+    if (ret & RET_SKIP_LINE) script_h.skipLine();
+    if (ret & RET_REREAD) script_h.setCurrent(current);
+
+    return ret;
+}
+
+
+int BenchParser::run()
+{
+    if (open(script)) return -1;
+
+    script_h.reset();
+    reset();
+    setCurrentLabel("define");
+    readToken();
+
+    // Each token is charged for reading it as well as running it.
+    Uint64 read_ticks = 0;
+    unsigned long read_allocations = 0;
+
+    const Uint64 start = SDL_GetPerformanceCounter();
+    while (script_h.isText() || script_h.getStrBuf() != "end") {
+        Stat& stat = statFor(script_h.getStrBuf());
+
+        const unsigned long a = allocations;
+        const Uint64 t = SDL_GetPerformanceCounter();
+        int ret = step();
+        const unsigned long a2 = allocations;
+        const Uint64 t2 = SDL_GetPerformanceCounter();
+        if (!(ret & RET_NOREAD)) readToken();
+
+        stat.ticks += t2 - t + read_ticks;
+        stat.allocations += a2 - a + read_allocations;
+        read_ticks = SDL_GetPerformanceCounter() - t2;
+        read_allocations = allocations - a2;
+        ++stat.count;
+        ++statements;
+    }
+    total_ticks = SDL_GetPerformanceCounter() - start;
+
+    return 0;
+}
+
+
+void BenchParser::report(int top)
+{
+    const double freq = SDL_GetPerformanceFrequency();
+    const double seconds = total_ticks / freq;
+
+    unsigned long allocs = 0;
+    std::vector<Stat> sorted;
+    for (stats_t::iterator i = stats.begin(); i != stats.end(); ++i) {
+        allocs += i->second.allocations;
+        sorted.push_back(i->second);
+    }
+    std::sort(sorted.begin(), sorted.end());
+
+    printf("%s\n", (const char*) script);
+    printf("  %lu statements in %.3f s: %.0f statements/s\n",
+           statements, seconds, statements / seconds);
+    if (COUNTS_ALLOCATIONS)
+        printf("  %.3f allocations per statement\n",
+               statements ? double(allocs) / statements : 0.0);
+
+    printf("  %-16s %10s %12s %10s %8s\n",
+           "command", "count", "ns/each", "total ms", "allocs");
+    for (int i = 0; i < (int) sorted.size() && i < top; ++i) {
+        const Stat& s = sorted[i];
+        printf("  %-16s %10lu %12.1f %10.2f %8.2f\n",
+               (const char*) s.name, s.count,
+               s.ticks / freq * 1e9 / s.count, s.ticks / freq * 1e3,
+               double(s.allocations) / s.count);
+    }
+    printf("\n");
+}
+
+
+int main(int argc, char** argv)
+{
+    // Nothing here should touch the display or sound, but make sure.
+    SDL_setenv("SDL_VIDEODRIVER", "dummy", 1);
+    SDL_setenv("SDL_AUDIODRIVER", "dummy", 1);
+    loguru::g_stderr_verbosity = loguru::Verbosity_WARNING;
+
+    int top = 20;
+    int scripts = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--top") && i + 1 < argc) {
+            top = atoi(argv[++i]);
+            continue;
+        }
+
+        BenchParser bench(argv[i]);
+        if (bench.run()) {
+            fprintf(stderr, "ponscr-bench: can't open %s\n", argv[i]);
+            return 1;
+        }
+        bench.report(top);
+        ++scripts;
+    }
+
+    if (!scripts) {
+        fprintf(stderr, "Usage: ponscr-bench [--top n] script...\n");
+        return 1;
+    }
+    return 0;
+}